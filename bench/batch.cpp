@@ -0,0 +1,61 @@
+#include "qr_batch.h"
+#include <cstdio>
+#include <chrono>
+#include <memory>
+
+// Encode the same 64 payloads one by one and with Batch, check that codes are identical. Single
+// codes use the same mask policy, which is already the fastest single path with the same output:
+// packed lines up to V11, whole lines (auto) or sampled lines (fast) after it.
+template<int V>
+void compare(qr::Ecc ecc, int mask, int rounds)
+{
+    constexpr int N = qr::Batch<V>::MAX_CODES;
+
+    char payloads[N][32];
+    qr::Span spans[N];
+
+    for (int i = 0; i < N; ++i)
+        spans[i] = { payloads[i], size_t(snprintf(payloads[i], sizeof(payloads[i]), "ID-%08d-%d", i * 7919, i)) };
+
+    auto single = std::make_unique<qr::Qr<V>[]>(N);
+    auto batched = std::make_unique<qr::Qr<V>[]>(N);
+    auto batch = std::make_unique<qr::Batch<V>>();
+
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        for (int i = 0; i < N; ++i)
+            single[i].encode(spans[i].str, spans[i].len, ecc, mask);
+    }
+    double s1 = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r)
+        batch->encode(spans, N, ecc, mask, batched.get());
+    double s2 = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int diff = 0;
+    for (int i = 0; i < N; ++i) {
+        for (int y = 0; y < single[i].side_size(); ++y) {
+            for (int x = 0; x < single[i].side_size(); ++x)
+                diff += single[i].module(x, y) != batched[i].module(x, y);
+        }
+    }
+
+    const char *policy = mask == qr::MASK_AUTO ? "auto" : mask == qr::MASK_FAST ? "fast" : "manual";
+    const char *path = mask < 0 && qr::VERSION<V>.side <= 63 ? "packed" : 
+        mask == qr::MASK_AUTO ? "lines" : mask == qr::MASK_FAST ? "sampled" : "-";
+
+    printf("%7d %-7s %-8s %12.0f %12.0f %8.1fx %6d\n", V, policy, path,
+        N * rounds / s1, N * rounds / s2, s1 / s2, diff);
+}
+
+int main(int, char**)
+{
+    printf("Version  Mask    Scorer   Single [codes/s]  Batch  Speedup  Diff\n");
+    for (int mask : { int(qr::MASK_AUTO), int(qr::MASK_FAST), 0 }) {
+        compare<1>(qr::M, mask, 200);
+        compare<5>(qr::M, mask, 50);
+        compare<10>(qr::M, mask, 20);
+        compare<40>(qr::M, mask, 2);
+    }
+}
@@ -0,0 +1,89 @@
+#include "qr.h"
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+
+template<int V>
+bool same(const qr::Qr<V> &a, const qr::Qr<V> &b)
+{
+    for (int y = 0; y < a.side_size(); ++y) {
+        for (int x = 0; x < a.side_size(); ++x) {
+            if (a.module(x, y) != b.module(x, y))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Compare MASK_FAST against exact MASK_AUTO over random payloads: penalty of selected 
+// mask (scored exactly), share of codes where the same mask is picked (codes are identical) 
+// and time of the whole encode.
+template<int V>
+void evaluate(int n_codes)
+{
+    static qr::Qr<V> exact;
+    static qr::Qr<V> fast;
+    static char str[8000];
+
+    double gap_sum  = 0;
+    double gap_max  = 0;
+    double t_exact  = 0;
+    double t_fast   = 0;
+    int n_same      = 0;
+    int n_total     = 0;
+
+    srand(V);
+
+    for (int i = 0; i < n_codes; ++i) {
+
+        auto ecc = qr::Ecc(rand() % 4);
+        size_t len = rand() % (exact.data_capacity(ecc) / 8 - 2) + 1;
+
+        for (size_t j = 0; j < len; ++j)
+            str[j] = rand() % 3 ? '0' + rand() % 10 : 'A' + rand() % 58;
+
+        auto t0 = std::chrono::steady_clock::now();
+        bool ok = exact.encode(str, len, ecc, qr::MASK_AUTO);
+        auto t1 = std::chrono::steady_clock::now();
+        fast.encode(str, len, ecc, qr::MASK_FAST);
+        auto t2 = std::chrono::steady_clock::now();
+
+        if (!ok)
+            continue;
+
+        int a = exact.penalty_score();
+        int b = fast.penalty_score();
+        double gap = double(b - a) / a * 100;
+
+        gap_sum += gap;
+        gap_max  = gap > gap_max ? gap : gap_max;
+        n_same  += same(exact, fast);
+        t_exact += std::chrono::duration<double, std::micro>(t1 - t0).count();
+        t_fast  += std::chrono::duration<double, std::micro>(t2 - t1).count();
+        ++n_total;
+    }
+    printf("V%-2d  %5d  %8.2f %%  %8.2f %%  %6.1f %%     %9.1f us  %9.1f us  %5.2fx\n", 
+        V, n_total, gap_sum / n_total, gap_max, 100.0 * n_same / n_total, 
+        t_exact / n_total, t_fast / n_total, t_exact / t_fast);
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 200;
+
+    printf("Ver  Codes  Mean gap   Max gap    Same mask  Exact        Fast         Speedup\n");
+    evaluate<1>(n);
+    evaluate<2>(n);
+    evaluate<3>(n);
+    evaluate<5>(n);
+    evaluate<7>(n);
+    evaluate<10>(n);
+    evaluate<11>(n);
+    evaluate<12>(n);
+    evaluate<13>(n);
+    evaluate<15>(n);
+    evaluate<20>(n);
+    evaluate<25>(n);
+    evaluate<30>(n);
+    evaluate<40>(n / 4);
+}
@@ -0,0 +1,40 @@
+#include "qr.h"
+#include <cstdio>
+#include <chrono>
+#include <tuple>
+#include <utility>
+
+// Encode the same payload with versions alternating on every call, 
+// so that code of every instantiation competes for instruction cache.
+template<int... V>
+double throughput(std::integer_sequence<int, V...>, int mask, int rounds)
+{
+    static constexpr auto str = "HELLO WORLD 0123";
+
+    std::tuple<qr::Qr<V + 1>...> codes;
+    int ok = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i)
+        ok += (std::get<V>(codes).encode(str, strlen(str), qr::M, mask) + ...);
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return ok / s;
+}
+
+int main(int, char**)
+{
+    printf("Versions  Manual mask    Fast mask    Auto mask  [codes/s]\n");
+    printf("1-4     %12.0f %12.0f %12.0f\n", 
+        throughput(std::make_integer_sequence<int, 4>(), 0, 2000), 
+        throughput(std::make_integer_sequence<int, 4>(), qr::MASK_FAST, 200),
+        throughput(std::make_integer_sequence<int, 4>(), qr::MASK_AUTO, 200));
+    printf("1-10    %12.0f %12.0f %12.0f\n", 
+        throughput(std::make_integer_sequence<int, 10>(), 0, 500), 
+        throughput(std::make_integer_sequence<int, 10>(), qr::MASK_FAST, 50),
+        throughput(std::make_integer_sequence<int, 10>(), qr::MASK_AUTO, 50));
+    printf("1-40    %12.0f %12.0f %12.0f\n", 
+        throughput(std::make_integer_sequence<int, 40>(), 0, 50), 
+        throughput(std::make_integer_sequence<int, 40>(), qr::MASK_FAST, 5),
+        throughput(std::make_integer_sequence<int, 40>(), qr::MASK_AUTO, 5));
+}
@@ -0,0 +1,72 @@
+#include "qr_pipeline.h"
+#include <cstdio>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+// Encode and render a stream of labels assembled from prefix, serial number and checksum, 
+// sequentially and with stages running on separate threads. Mask and ECC stages get more 
+// workers, since they are the slowest. Pipeline must pass codes to sink in order of labels.
+int main(int argc, char **argv)
+{
+    constexpr auto ver = 10;
+    constexpr auto ecc = qr::Ecc::M;
+
+    const size_t n_codes = argc > 1 ? atoi(argv[1]) : 2000;
+    const int mask = argc > 2 ? atoi(argv[2]) : qr::MASK_FAST;
+    const int mask_workers = argc > 3 ? atoi(argv[3]) : 2;
+    const int ecc_workers = argc > 4 ? atoi(argv[4]) : 1;
+
+    static qr::Pipeline<ver> pipeline;
+    static qr::Qr<ver> codec;
+    static uint8_t image[(codec.side_size() + 8) * (codec.side_size() + 8)];
+    std::vector<qr::Qr<ver>> expected(n_codes);
+
+    char serial[24];
+    char checksum[4];
+    qr::Span spans[3] = { { "HTTPS://EXAMPLE.COM/", 20 }, { serial, 10 }, { checksum, 2 } };
+    size_t i = 0;
+
+    auto next = [&](qr::Pipeline<ver>::Request &req) {
+        if (i == n_codes)
+            return false;
+        snprintf(serial, sizeof(serial), "%010zu", i);
+        snprintf(checksum, sizeof(checksum), "%02zu", i * 7 % 100);
+        req = { spans, 3, ecc, mask };
+        ++i;
+        return true;
+    };
+    size_t n_ok = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (qr::Pipeline<ver>::Request req; next(req);) {
+        n_ok += codec.encode(req.spans, req.n, req.ecc, req.mask);
+        qr::render(codec, image);
+        expected[i - 1] = codec;
+    }
+    double seq = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t n_sunk = 0;
+    size_t n_out_of_order = 0;
+
+    i = 0;
+    pipeline.set_workers(qr::S_MASK, mask_workers);
+    pipeline.set_workers(qr::S_ECC, ecc_workers);
+    pipeline.run(next, [&](const qr::Qr<ver> &code, const uint8_t *img, bool ok) {
+        n_ok += ok;
+        n_out_of_order += memcmp(&code, &expected[n_sunk++], sizeof(code)) != 0;
+        image[0] = img[0];
+    });
+
+    printf("Sequential: %10.0f codes/s\n", n_codes / seq);
+    printf("Pipeline:   %10.0f codes/s  (%u hardware threads)\n\n", n_codes / pipeline.elapsed(), std::thread::hardware_concurrency());
+    printf("Out of order: %zu\n\n", n_out_of_order);
+    printf("Stage  Workers  Items   Throughput    Queue avg   Queue max\n");
+
+    for (int s = 0; s < qr::N_STAGES; ++s) {
+        const auto &st = pipeline.stats(qr::Stage(s));
+        printf("%-6s %7d %6zu %10.0f/s %11.1f %11zu\n", pipeline.stage_name(qr::Stage(s)), 
+            st.workers, st.items, st.throughput(), st.depth_avg(), st.depth_max);
+    }
+    return n_ok != 2 * n_codes || n_out_of_order;
+}
@@ -0,0 +1,21 @@
+#include "qr.h"
+#include <utility>
+
+// Binary with Qr<1> .. Qr<QR_VERSIONS> instantiated, to compare code size 
+// for different number of versions supported by application.
+#ifndef QR_VERSIONS
+#define QR_VERSIONS 1
+#endif
+
+template<int... V>
+int encode_all(std::integer_sequence<int, V...>, const char *str, size_t len)
+{
+    int res = 0;
+    ((res += qr::Qr<V + 1>().encode(str, len, qr::M, -1)), ...);
+    return res;
+}
+
+int main(int argc, char **argv)
+{
+    return encode_all(std::make_integer_sequence<int, QR_VERSIONS>(), argv[0], argc);
+}
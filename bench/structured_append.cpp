@@ -0,0 +1,79 @@
+#include "qr_structured.h"
+#include <cstdio>
+#include <chrono>
+
+template<class F>
+double measure(F &&f, int n)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i)
+        f();
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / n;
+}
+
+template<int V>
+void bench_structured(const char *str, size_t len, qr::Ecc ecc, double single)
+{
+    static qr::Qr<V> set[16];
+    int cnt = qr::encode_structured(str, len, ecc, set, 16);
+    double us = measure([&] { qr::encode_structured(str, len, ecc, set, 16); }, 20);
+    double par = measure([&] { qr::encode_structured_parallel(str, len, ecc, set, 16); }, 20);
+
+    if (cnt)
+        printf("%2d x V%-2d  %10.1f us  %5.2fx  %10.1f us  %5.2fx  %4d\n", cnt, V, us, single / us, par, single / par, cnt * V);
+    else
+        printf("   V%-2d     does not fit\n", V);
+}
+
+// Versions of each code are picked from MinV to MaxV by the least sum of versions.
+template<int MinV, int MaxV>
+void bench_mixed(const char *str, size_t len, qr::Ecc ecc, double single)
+{
+    static uint8_t buf[16 * qr::VERSION<MaxV>.n_bytes];
+    static qr::Symbol set[16];
+    int cnt = qr::encode_structured<MinV, MaxV>(str, len, ecc, set, 16, buf, sizeof(buf));
+    double us = measure([&] { qr::encode_structured<MinV, MaxV>(str, len, ecc, set, 16, buf, sizeof(buf)); }, 20);
+    double par = measure([&] { qr::encode_structured_parallel<MinV, MaxV>(str, len, ecc, set, 16, buf, sizeof(buf)); }, 20);
+    int sum = 0;
+
+    for (int i = 0; i < cnt; ++i)
+        sum += set[i].ver;
+
+    if (cnt) {
+        printf("%2d x V%d-%-2d %8.1f us  %5.2fx  %10.1f us  %5.2fx  %4d  (", cnt, MinV, MaxV, us, single / us, par, single / par, sum);
+        for (int i = 0; i < cnt; ++i)
+            printf(i ? " %d" : "%d", set[i].ver);
+        printf(")\n");
+    } else {
+        printf("   V%d-%-2d   does not fit\n", MinV, MaxV);
+    }
+}
+
+int main(int, char**)
+{
+    constexpr auto ecc = qr::Ecc::M;
+    static char str[2300];
+
+    for (size_t i = 0; i < sizeof(str); ++i)
+        str[i] = 'a' + i % 26;
+
+    static qr::Qr<40> single;
+    double us = measure([&] { single.encode(str, sizeof(str), ecc); }, 20);
+
+    printf("Payload: %zu bytes, Ecc M, automatic mask, %u hardware threads\n", 
+        sizeof(str), std::thread::hardware_concurrency());
+    printf("                 Serial             Parallel            Sum of versions\n");
+    printf(" 1 x V40  %10.1f us                                     40\n", us);
+
+    bench_structured<10>(str, sizeof(str), ecc, us);
+    bench_structured<15>(str, sizeof(str), ecc, us);
+    bench_structured<20>(str, sizeof(str), ecc, us);
+    bench_structured<25>(str, sizeof(str), ecc, us);
+    bench_structured<30>(str, sizeof(str), ecc, us);
+
+    bench_mixed<1, 10>(str, sizeof(str), ecc, us);
+    bench_mixed<1, 15>(str, sizeof(str), ecc, us);
+    bench_mixed<1, 20>(str, sizeof(str), ecc, us);
+    bench_mixed<1, 25>(str, sizeof(str), ecc, us);
+    bench_mixed<1, 30>(str, sizeof(str), ecc, us);
+}
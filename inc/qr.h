@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <cstring>
 #include <cmath>
+#include <initializer_list>
 
 namespace qr {
 
@@ -125,6 +126,81 @@ constexpr void add_bits(uint16_t data, int n, uint8_t *arr, size_t &pos)
     }
 }
 
+// Read up to 16 bits from arr. Counterpart of add_bits().
+constexpr uint16_t get_bits(const uint8_t *arr, int n, size_t &pos)
+{
+    uint16_t data = 0;
+
+    while (n--) {
+        data = (data << 1) | get_bit_r(arr, pos);
+        ++pos;
+    }
+    return data;
+}
+
+// Number of set bits in an integer.
+constexpr int popcount(uint32_t x)
+{
+    int n = 0;
+
+    for (; x; x &= x - 1)
+        ++n;
+    return n;
+}
+
+// Transpose 8x8 bit matrix stored by rows, row i is byte i and column j is bit j of it.
+constexpr uint64_t transpose_8x8(uint64_t x)
+{
+    uint64_t t = 0;
+
+    t = (x ^ (x >> 7))  & 0x00AA00AA00AA00AAull;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCull;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ull;
+    x = x ^ t ^ (t << 28);
+
+    return x;
+}
+
+// Number of set bits in 64-bit word.
+constexpr int popcount64(uint64_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+
+    return int((x * 0x0101010101010101ull) >> 56);
+}
+
+// Transpose 64x64 bit matrix in place, bit j of a[i] goes to bit i of a[j].
+constexpr void transpose_64x64(uint64_t *a)
+{
+    uint64_t m = 0x00000000FFFFFFFFull;
+
+    for (int j = 32; j; j >>= 1, m ^= m << j) {
+        for (int k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+            uint64_t t = ((a[k] >> j) ^ a[k | j]) & m;
+            a[k]     ^= t << j;
+            a[k | j] ^= t;
+        }
+    }
+}
+
+// Read n <= 64 bits of array starting from n-th bit (starting from LSB of each byte).
+constexpr uint64_t get_arr_bits(const uint8_t *p, int pos, int n)
+{
+    const int shift = pos & 7;
+    uint64_t res = 0;
+
+    p += pos >> 3;
+    res = p[0] >> shift;
+    for (int k = 1; k * 8 < n + shift; ++k)
+        res |= uint64_t(p[k]) << (k * 8 - shift);
+
+    return n < 64 ? res & (~0ull >> (64 - n)) : res;
+}
+
 // Translate char to alphanumeric encoding value,
 constexpr int alphanumeric(char c)
 {
@@ -166,13 +242,23 @@ constexpr bool is_numeric(const char *str, size_t len)
     return true;
 }
 
+// Check if pair of bytes is Shift JIS kanji, which can be encoded in kanji mode. Trail byte
+// comes first, the same way encode_data() packs pairs and decode_data() restores them.
+constexpr bool is_kanji_pair(uint8_t trail, uint8_t lead)
+{
+    uint16_t val = trail | lead << 8;
+
+    return  trail >= 0x40 && trail <= 0xfc && trail != 0x7f && 
+            val >= 0x8140 && val <= 0xebbf && (val <= 0x9ffc || val >= 0xe040);
+}
+
 // Check if string can be encoded in kanji mode.
 constexpr bool is_kanji(const char *str, size_t len) 
 {
+    if (len & 1)
+        return false;
     for (size_t i = 0; i < len; i += 2) {
-        uint16_t val = uint16_t(str[i]) | (uint16_t(str[i + 1]) << 8);
-        if (val < 0x8140 || 
-            val > 0xebbf || (val > 0x9ffc && val < 0xe040))
+        if (!is_kanji_pair(str[i], str[i + 1]))
             return false;
     }
     return true;
@@ -207,18 +293,149 @@ constexpr void gf_gen_poly(int degree, uint8_t *poly)
     }
 }
 
-// Polynomial division if Galois Field.
+// Exponent and logarithm tables of Galois 2^8 field. Exponent table is 
+// doubled to avoid modulo in table-driven multiplication.
+struct GfTables {
+    uint8_t exp[512] = {};
+    uint8_t log[256] = {};
+};
+
+constexpr GfTables gf_make_tables()
+{
+    GfTables t;
+    uint8_t x = 1;
+
+    for (int i = 0; i < 255; ++i) {
+        t.exp[i] = t.exp[i + 255] = x;
+        t.log[x] = i;
+        x = (x << 1) ^ ((x >> 7) * 0x11d);
+    }
+    return t;
+}
+
+inline constexpr GfTables GF = gf_make_tables();
+
+// Table-driven Galois 2^8 field multiplication.
+constexpr uint8_t gf_mul_t(uint8_t x, uint8_t y)
+{
+    return x && y ? GF.exp[GF.log[x] + GF.log[y]] : 0;
+}
+
+// Table-driven Galois 2^8 field division. Divisor must be non-zero.
+constexpr uint8_t gf_div(uint8_t x, uint8_t y)
+{
+    return x ? GF.exp[GF.log[x] + 255 - GF.log[y]] : 0;
+}
+
+// Polynomial division if Galois Field. Log of factor is taken once per step, 
+// so each term costs one table lookup.
 constexpr void gf_poly_div(const uint8_t *dividend, size_t len, const uint8_t *divisor, int degree, uint8_t *result) 
 {
-    memset(result, 0, degree);
+    uint8_t log_div[30] = {};
+
+    for (int j = 0; j < degree; ++j) {
+        log_div[j] = GF.log[divisor[j]];
+        result[j]  = 0;
+    }
 
     for (size_t i = 0; i < len; ++i) {
         uint8_t factor = dividend[i] ^ result[0];
         memmove(&result[0], &result[1], degree - 1);
         result[degree - 1] = 0;
-        for (int j = 0; j < degree; ++j)
-            result[j] ^= gf_mul(divisor[j], factor);
+        if (!factor)
+            continue;
+        for (int j = 0; j < degree; ++j) {
+            if (divisor[j])
+                result[j] ^= GF.exp[log_div[j] + GF.log[factor]];
+        }
+    }
+}
+
+// Check syndromes of Reed-Solomon block with `degree` Ecc codewords at the end and correct it 
+// in place using Berlekamp-Massey, Chien search and Forney algorithm. Return number of 
+// corrected errors or -1 if block is uncorrectable or needs more than `max_errors` corrections.
+constexpr int gf_rs_correct(uint8_t *block, int len, int degree, int max_errors)
+{
+    uint8_t synd[30]    = {};
+    uint8_t lambda[31]  = { 1 };
+    uint8_t prev[31]    = { 1 };
+    uint8_t omega[30]   = {};
+    bool clean = true;
+
+    for (int i = 0; i < degree; ++i) {
+        uint8_t s = 0;
+        for (int j = 0; j < len; ++j)
+            s = (s ? GF.exp[GF.log[s] + i] : 0) ^ block[j];
+        synd[i] = s;
+        clean &= !s;
+    }
+    if (clean)
+        return 0;
+
+    int n_err = 0;
+    int shift = 1;
+    uint8_t last = 1;
+
+    for (int i = 0; i < degree; ++i, ++shift) {
+
+        uint8_t delta = synd[i];
+
+        for (int j = 1; j <= n_err; ++j)
+            delta ^= gf_mul_t(lambda[j], synd[i - j]);
+
+        if (!delta)
+            continue;
+
+        uint8_t coef = gf_div(delta, last);
+        uint8_t tmp[31] = {};
+
+        for (int j = 0; j <= degree; ++j)
+            tmp[j] = lambda[j];
+        for (int j = 0; j + shift <= degree; ++j)
+            lambda[j + shift] ^= gf_mul_t(coef, prev[j]);
+
+        if (2 * n_err <= i) {
+            for (int j = 0; j <= degree; ++j)
+                prev[j] = tmp[j];
+            n_err = i + 1 - n_err;
+            last = delta;
+            shift = 0;
+        }
+    }
+    if (n_err > max_errors || 2 * n_err > degree)
+        return -1;
+
+    for (int i = 0; i < degree; ++i)
+        for (int j = 0; j <= n_err && j <= i; ++j)
+            omega[i] ^= gf_mul_t(lambda[j], synd[i - j]);
+
+    int found = 0;
+
+    for (int e = 0; e < len; ++e) {
+
+        int inv = (255 - e) % 255;
+        uint8_t x_inv = GF.exp[inv];
+        uint8_t val = 0;
+
+        for (int j = n_err; j >= 0; --j)
+            val = gf_mul_t(val, x_inv) ^ lambda[j];
+        if (val)
+            continue;
+
+        uint8_t num = 0;
+        uint8_t den = 0;
+
+        for (int j = degree - 1; j >= 0; --j)
+            num = gf_mul_t(num, x_inv) ^ omega[j];
+        for (int j = 1; j <= n_err; j += 2)
+            den ^= gf_mul_t(lambda[j], GF.exp[inv * (j - 1) % 255]);
+        if (!den)
+            return -1;
+
+        block[len - 1 - e] ^= gf_mul_t(GF.exp[e], gf_div(num, den));
+        ++found;
     }
+    return found == n_err ? n_err : -1;
 }
 
 enum Ecc { 
@@ -228,6 +445,19 @@ enum Ecc {
     H,
 };
 
+// Number of Ecc codewords reserved for misdecode protection, they detect errors but aren't 
+// used to correct them (ISO/IEC 18004, Table 9). Only small codes of low levels have them.
+constexpr int misdecode_codewords(int ver, Ecc ecc)
+{
+    if (ver == 1)
+        return ecc == L ? 3 : ecc == M ? 2 : 1;
+    if (ver == 2 && ecc == L)
+        return 2;
+    if (ver == 3 && ecc == L)
+        return 1;
+    return 0;
+}
+
 enum Mode { 
     M_NUMERIC,
     M_ALPHANUMERIC,
@@ -235,18 +465,70 @@ enum Mode {
     M_KANJI,
 };
 
-// Select appropriate encoding mode for string.
-constexpr Mode select_mode(const char *str, size_t len)
+// Automatic mask selection policies, can be passed instead of manual mask 0-7.
+enum MaskPolicy {
+    MASK_AUTO = -1,     // Exact penalty score of all 8 masks, on packed lines up to V11
+    MASK_FAST = -2,     // The same up to V11, sampled rows and columns after
+};
+
+// Piece of payload. Payload may consist of several spans, which aren't contiguous in memory.
+struct Span {
+    const char *str;
+    size_t len;
+};
+
+// Select appropriate encoding mode for payload split into spans, in one pass.
+constexpr Mode select_mode(const Span *spans, size_t n)
 {
-    if (is_numeric(str, len))
+    bool numeric    = true;
+    bool alnum      = true;
+    bool kanji      = true;
+    size_t len      = 0;
+    uint8_t trail   = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < spans[i].len; ++j, ++len) {
+
+            char c = spans[i].str[j];
+
+            numeric &= c >= '0' && c <= '9';
+            alnum   &= alphanumeric(c) != -1;
+
+            if (len & 1)
+                kanji &= is_kanji_pair(trail, c);
+            else
+                trail = c;
+        }
+    }
+
+    if (numeric)
         return M_NUMERIC;
-    if (is_alphanumeric(str, len))
+    if (alnum)
         return M_ALPHANUMERIC;
-    if (is_kanji(str, len))
+    if (kanji && !(len & 1))
         return M_KANJI;
     return M_BYTE;
 }
 
+// Select appropriate encoding mode for string.
+constexpr Mode select_mode(const char *str, size_t len)
+{
+    Span span = { str, len };
+
+    return select_mode(&span, 1);
+}
+
+// Number of bits required to encode `len` characters in given mode, without mode indicator and CCI.
+constexpr size_t data_bits(Mode mode, size_t len)
+{
+    switch (mode) {
+        case M_NUMERIC:         return 10 * (len / 3) + (len % 3 == 2 ? 7 : len % 3 == 1 ? 4 : 0);
+        case M_ALPHANUMERIC:    return 11 * (len / 2) + 6 * (len & 1);
+        case M_BYTE:            return 8 * len;
+        default:                return 13 * (len / 2);
+    }
+}
+
 // Return size of Character Control Indicator in bits for given version and mode.
 constexpr int cci(int ver, Mode mode)
 {
@@ -263,198 +545,495 @@ constexpr int cci(int ver, Mode mode)
     return cnt[mode][2];
 }
 
-template<int V>
-struct Qr {
-    constexpr auto side_size() const { return SIDE; }
-    bool module(int x, int y) const;
-    bool encode(const char *str, size_t len, Ecc ecc, int mask = -1);
-private:
-    bool encode_data(const char *data, size_t len, Ecc ecc, uint8_t *out);
-    void encode_ecc(const uint8_t *data, Ecc ecc, uint8_t *out);
+// Whether module at given position keeps its color under mask, i.e. isn't inverted.
+constexpr bool mask_keep(int mask, int x, int y)
+{
+    switch (mask) {
+        case 0: return  (x + y) & 1;
+        case 1: return   y & 1;
+        case 2: return   x % 3;
+        case 3: return  (x + y) % 3;
+        case 4: return  (y / 2 + x / 3) & 1;
+        case 5: return   x * y  % 2 + x * y % 3;
+        case 6: return  (x * y  % 2 + x * y % 3) & 1;
+        case 7: return ((x + y) % 2 + x * y % 3) & 1;
+    }
+    return true;
+}
 
-    void add_data(const uint8_t *data, const uint8_t *patterns);
-    void add_patterns();
-    void add_version();
-    void add_format(Ecc ecc, int mask);
-    void reserve_patterns(uint8_t *out);
+// Format information bits with BCH error correction and mask applied.
+constexpr int format_bits(Ecc ecc, int mask)
+{
+    int data = (ecc ^ 1) << 3 | mask;
+    int rem = data;
 
-    template<bool Black>
-    void draw_rect(int y, int x, int height, int width, uint8_t *out);
-    template<bool Black>
-    void draw_bound(int y, int x, int height, int width, uint8_t *out);
-    
-    template<bool Horizontal>
-    int  rule_1_3_score();
-    int  penalty_score();
-    int  select_mask(Ecc ecc, const uint8_t *patterns);
-    void apply_mask(int mask, const uint8_t *patterns);
-private:
-    static_assert(V >= 1 && V <= 40, "invalid version");
-    static constexpr int SIDE           = 17 + V * 4;
-    static constexpr int N_BITS         = SIDE * SIDE;
-    static constexpr int N_ALIGN        = V == 1 ? 0 : V / 7 + 2;
-    static constexpr int N_ALIGN_BITS   = V > 1 ? (N_ALIGN * N_ALIGN - 3) * 25 : 0;
-    static constexpr int N_TIMING_BITS  = (SIDE - 16) * 2 - (10 * (V > 1 ? N_ALIGN - 2 : 0));
-    static constexpr int N_VER_BITS     = V > 6 ? 36 : 0;
-    static constexpr int N_DAT_BITS     = N_BITS - (192 + N_ALIGN_BITS + N_TIMING_BITS + 31 + N_VER_BITS);
-    static constexpr int N_BYTES        = bytes_in_bits(N_BITS);        // Actual number of bytes_in_bits required to store whole Qr code
-    static constexpr int N_DAT_BYTES    = bytes_in_bits(N_DAT_BITS);    // Actual number of bytes_in_bits required to store [data + ecc]
-    static constexpr int N_DAT_CAPACITY = N_DAT_BITS >> 3;              // Capacity of [data + ecc] without remainder bits
-private:
-    uint8_t code[N_BYTES] = {};
-    bool status = false;
+    for (int i = 0; i < 10; i++)
+        rem = (rem << 1) ^ ((rem >> 9) * 0b10100110111);
+
+    return (data << 10 | rem) ^ 0b101010000010010;
+}
+
+// Position of i-th format information bit in the first or in the second copy of it.
+constexpr int format_coord(int side, int i, bool second)
+{
+    if (i < 6)
+        return second ? side * i + 8 : side * 8 + side - 1 - i;
+    if (i < 8)
+        return second ? side * (i + 1) + 8 : side * 8 + side - 1 - i;
+    if (i == 8)
+        return second ? side * (side - 7) + 8 : side * 8 + 7;
+
+    return second ? side * (side - 1 - (14 - i)) + 8 : side * 8 + (14 - i);
+}
+
+// Version information bits with BCH error correction.
+constexpr uint32_t version_bits(int ver)
+{
+    uint32_t rem = ver;
+
+    for (uint8_t i = 0; i < 12; ++i)
+        rem = (rem << 1) ^ ((rem >> 11) * 0x1F25);
+
+    return ver << 12 | rem;
+}
+
+// Compact descriptor of a version: geometry, sizes and pointers to precomputed tables. 
+// It's all the non-templated Kernel needs, so that code isn't duplicated for every Qr<V>.
+struct Version {
+    int ver;
+    int side;
+    int n_bits;
+    int n_bytes;            // Actual number of bytes required to store whole Qr code
+    int n_dat_bits;
+    int n_dat_bytes;        // Actual number of bytes required to store [data + ecc]
+    int n_dat_capacity;     // Capacity of [data + ecc] without remainder bits
+    int n_align;
+    int sample_step;        // Every n-th row and column scored by MASK_FAST, 0 - packed lines
+    const uint8_t *patterns;
+    const uint8_t *skeleton;
+
+    constexpr size_t data_capacity(Ecc ecc) const;
 };
 
-// Get color of a module from left-to-right and top-to-bottom. Black is true.
-template<int V>
-bool Qr<V>::module(int x, int y) const
+// Number of bits available for data (without Ecc) with given error correction level.
+constexpr size_t Version::data_capacity(Ecc ecc) const
 {
-    return get_arr_bit(code, y * SIDE + x);
+    return (n_dat_capacity - ECC_CODEWORDS_PER_BLOCK[ecc][ver] * N_ECC_BLOCKS[ecc][ver]) << 3;
 }
 
-// Create Qr code with given error correction level. If mask == -1, 
-// then best mask selected automatically. NOTE: Automatic mask is the 
-// most expensive operation. Takes about 95 % of all computation time.
-template<int V>
-bool Qr<V>::encode(const char *str, size_t len, Ecc ecc, int mask)
+// Descriptor of given version. Tables are attached by VERSION<V>.
+constexpr Version make_version(int ver, const uint8_t *patterns = nullptr, const uint8_t *skeleton = nullptr)
 {
-    uint8_t data[N_DAT_BYTES]           = {};
-    uint8_t data_with_ecc[N_DAT_BYTES]  = {};
-    uint8_t patterns[N_BYTES]           = {};
+    int side        = 17 + ver * 4;
+    int n_bits      = side * side;
+    int n_align     = ver == 1 ? 0 : ver / 7 + 2;
+    int align_bits  = ver > 1 ? (n_align * n_align - 3) * 25 : 0;
+    int timing_bits = (side - 16) * 2 - (10 * (ver > 1 ? n_align - 2 : 0));
+    int ver_bits    = ver > 6 ? 36 : 0;
+    int dat_bits    = n_bits - (192 + align_bits + timing_bits + 31 + ver_bits);
+
+    return { 
+        ver, 
+        side, 
+        n_bits, 
+        int(bytes_in_bits(n_bits)), 
+        dat_bits, 
+        int(bytes_in_bits(dat_bits)), 
+        dat_bits >> 3, 
+        n_align, 
+        side <= 63 ? 0 : ver < 14 ? 2 : 3, 
+        patterns, 
+        skeleton, 
+    };
+}
 
-    if (!encode_data(str, len, ecc, data)) {
-        return status = false;
+template<bool B>
+constexpr void draw_rect(const Version &v, int y, int x, int height, int width, uint8_t *out)
+{
+    if (B) {
+        for (int dy = y * v.side; dy < (y + height) * v.side; dy += v.side)
+            for (int dx = x; dx < x + width; ++dx) 
+                set_arr_bit(out, dy + dx);
+    } else {
+        for (int dy = y * v.side; dy < (y + height) * v.side; dy += v.side)
+            for (int dx = x; dx < x + width; ++dx)
+                clr_arr_bit(out, dy + dx);
     }
-    encode_ecc(data, ecc, data_with_ecc);
-
-    reserve_patterns(patterns);
-    memcpy(code, patterns, N_BYTES);
+}
 
-    add_data(data_with_ecc, patterns);
-    add_patterns();
-    add_version();
+template<bool B>
+constexpr void draw_bound(const Version &v, int y, int x, int height, int width, uint8_t *out)
+{
+    if (B) {
+        for (int i = y * v.side + x;              i < y * v.side + x+width;                 ++i)
+            set_arr_bit(out, i);
+        for (int i = (y+height-1) * v.side + x;   i < (y+height-1) * v.side + x+width;      ++i)
+            set_arr_bit(out, i);
+        for (int i = (y+1) * v.side + x;          i < (y+height-1) * v.side + x;            i += v.side)
+            set_arr_bit(out, i);
+        for (int i = (y+1) * v.side + x+width-1;  i < (y+height-1) * v.side + x+width-1;    i += v.side)
+            set_arr_bit(out, i);
+    } else {
+        for (int i = y * v.side + x;              i < y * v.side + x+width;                 ++i)
+            clr_arr_bit(out, i);
+        for (int i = (y+height-1) * v.side + x;   i < (y+height-1) * v.side + x+width;      ++i)
+            clr_arr_bit(out, i);
+        for (int i = (y+1) * v.side + x;          i < (y+height-1) * v.side + x;            i += v.side)
+            clr_arr_bit(out, i);
+        for (int i = (y+1) * v.side + x+width-1;  i < (y+height-1) * v.side + x+width-1;    i += v.side)
+            clr_arr_bit(out, i);
+    }
+}
 
-    mask = mask != -1 ? mask & 7 : select_mask(ecc, patterns);
+constexpr void reserve_patterns(const Version &v, uint8_t *out)
+{
+    draw_rect<true>(v, 0, 6, v.side, 1, out);
+    draw_rect<true>(v, 6, 0, 1, v.side, out);
+    
+    draw_rect<true>(v, 0, 0, 9, 9, out);
+    draw_rect<true>(v, v.side - 8, 0, 8, 9, out);
+    draw_rect<true>(v, 0, v.side - 8, 9, 8, out);
 
-    add_format(ecc, mask);
-    apply_mask(mask, patterns);
+    for (int i = 0; i < v.n_align; ++i) {
+        for (int j = 0; j < v.n_align; ++j) {
+            if ((!i && !j) || 
+                (!i && j == v.n_align - 1) || 
+                (!j && i == v.n_align - 1) )
+                continue;
+            draw_rect<true>(v, ALIGN_POS[v.ver][i] - 2, ALIGN_POS[v.ver][j] - 2, 5, 5, out);
+        }
+    }
 
-    return status = true;
+    if (v.ver >= 7) {
+        draw_rect<true>(v, v.side - 11, 0, 3, 6, out);
+        draw_rect<true>(v, 0, v.side - 11, 6, 3, out);
+    }
 }
 
-template<int V>
-bool Qr<V>::encode_data(const char *data, size_t len, Ecc ecc, uint8_t *out)
+constexpr void add_patterns(const Version &v, uint8_t *out)
 {
-    Mode mode = select_mode(data, len);
+    // White bounds inside finders
+    draw_bound<false>(v, 1, 1, 5, 5, out);
+    draw_bound<false>(v, 1, v.side - 6, 5, 5, out);
+    draw_bound<false>(v, v.side - 6, 1, 5, 5, out);
 
-    size_t n_bits = (N_DAT_CAPACITY - ECC_CODEWORDS_PER_BLOCK[ecc][V] * N_ECC_BLOCKS[ecc][V]) << 3;
-    size_t pos = 0;
+    // Finish alignment patterns
+    for (int i = 0; i < v.n_align; ++i) {
+        for (int j = 0; j < v.n_align; ++j) {
+            if ((!i && !j) || 
+                (!i && j == v.n_align - 1) || 
+                (!j && i == v.n_align - 1) )
+                continue;
+            draw_bound<false>(v, ALIGN_POS[v.ver][i] - 1, ALIGN_POS[v.ver][j] - 1, 3, 3, out);
+        }
+    }
 
-    add_bits(1 << mode, 4, out, pos);
-    add_bits(len, cci(V, mode), out, pos);
+    // Draw white separators
+    draw_rect<false>(v, 7, 0, 1, 8, out);
+    draw_rect<false>(v, 0, 7, 8, 1, out);
+    draw_rect<false>(v, v.side - 8, 0, 1, 8, out);
+    draw_rect<false>(v, v.side - 8, 7, 8, 1, out);
+    draw_rect<false>(v, 7, v.side - 8, 1, 8, out);
+    draw_rect<false>(v, 0, v.side - 8, 8, 1, out);
+
+    // Perforate timing patterns
+    for (int i = 7; i < v.side - 7; i += 2) {
+        clr_arr_bit(out, 6 * v.side + i);
+        clr_arr_bit(out, i * v.side + 6);
+    }
+}
 
-    if (mode == M_NUMERIC) {
+constexpr void add_version(const Version &v, uint8_t *out)
+{
+    if (v.ver < 7)
+        return;
 
-        const size_t triplets = len / 3;
-        const size_t triplets_size = triplets * 3;
-        const size_t rem = len % 3;
-        const size_t rem_bits = rem == 2 ? 7 : rem == 1 ? 4 : 0;
-        const size_t total_size = 10 * triplets + rem_bits;
+    uint32_t data = version_bits(v.ver);
 
-        if (pos + total_size > n_bits)
-            return false;
+    for (int x = 0; x < 6; ++x) {
+        for (int j = 0; j < 3; ++j) {
 
-        char buf[4] = {};
+            int y = v.side - 11 + j;
 
-        for (size_t i = 0; i < triplets_size; i += 3) {
-            buf[0] = data[i];
-            buf[1] = data[i + 1];
-            buf[2] = data[i + 2];
+            bool black = (data >> (x * 3 + j)) & 1;
 
-            uint16_t num = strtol(buf, NULL, 10);
-            add_bits(num, 10, out, pos);
+            if (!black) {
+                clr_arr_bit(out, y * v.side + x);
+                clr_arr_bit(out, y + v.side * x);
+            }
         }
+    }
+}
 
-        if (rem) {
-            buf[0] = data[triplets_size];
-            buf[1] = data[triplets_size + 1];
-            buf[rem] = 0;
 
-            uint16_t num = strtol(buf, NULL, 10);
-            add_bits(num, rem_bits, out, pos);
-        }
-    } else if (mode == M_ALPHANUMERIC) {
+// Precomputed images of blank code of version V, built at compile time. Patterns mark function 
+// modules, skeleton holds finished finder, alignment, timing and version patterns.
+template<int V>
+struct Tables {
+    static_assert(V >= 1 && V <= 40, "invalid version");
+    uint8_t patterns[make_version(V).n_bytes]   = {};
+    uint8_t skeleton[make_version(V).n_bytes]   = {};
+};
 
-        if (pos + 11 * (int(len & ~1ul) / 2) > n_bits)
-            return false;
+template<int V>
+constexpr Tables<V> make_tables()
+{
+    constexpr Version v = make_version(V);
 
-        for (int i = 0; i < int(len & ~1ul); i += 2) {
-            uint16_t num = alphanumeric(data[i]) * 45 + alphanumeric(data[i + 1]);
-            add_bits(num, 11, out, pos);
-        }
-        if (len & 1) {
-            if (pos + 6 > n_bits)
-                return false;
+    Tables<V> t;
 
-            add_bits(alphanumeric(data[len - 1]), 6, out, pos);
-        }
+    reserve_patterns(v, t.patterns);
 
-    } else if (mode == M_BYTE) {
+    for (int i = 0; i < v.n_bytes; ++i)
+        t.skeleton[i] = t.patterns[i];
 
-        if (pos + len * 8 > n_bits)
-            return false;
+    add_patterns(v, t.skeleton);
+    add_version(v, t.skeleton);
 
-        for (size_t i = 0; i < len; ++i)
-            add_bits(data[i], 8, out, pos);
+    return t;
+}
 
-    } else {
+template<int V>
+inline constexpr Tables<V> TABLES = make_tables<V>();
 
-        if (pos + 13 * (len / 2) > n_bits)
-            return false;
+template<int V>
+inline constexpr Version VERSION = make_version(V, TABLES<V>.patterns, TABLES<V>.skeleton);
+
+// All masks repeat every 12 modules in both directions, so one 12x12 tile of each is shared 
+// by all versions. Bit x of rows[mask][y] is set if module (x, y) is flipped by mask.
+struct MaskTiles {
+    uint16_t rows[8][12] = {};
+};
 
-        for (size_t i = 0; i < len; i += 2) {
-            uint16_t val = ((uint8_t) data[i]) | (((uint8_t) data[i + 1]) << 8);
-            uint16_t res = 0;
-            val -= val < 0x9FFC ? 0x8140 : 0xC140;
-            res += val & 0xff;
-            res += (val >> 8) * 0xc0;
-            add_bits(res, 13, out, pos);
+constexpr MaskTiles make_mask_tiles()
+{
+    MaskTiles t;
+
+    for (int mask = 0; mask < 8; ++mask) {
+        for (int y = 0; y < 12; ++y) {
+            for (int x = 0; x < 12; ++x)
+                t.rows[mask][y] |= !mask_keep(mask, x, y) << x;
         }
     }
+    return t;
+}
 
-    size_t padding = n_bits - pos;
-    size_t i = 0;
+inline constexpr MaskTiles MASK_TILES = make_mask_tiles();
 
-    add_bits(0, padding > 4 ? 4 : padding, out, pos);
-    
-    if (pos & 7)
-        add_bits(0, (8 - pos) & 7, out, pos);
+// Call f(i, bits) with bits of i-th byte of code flipped by mask, restricted to data modules. 
+// Rows don't start on byte boundary, so the same byte can come twice.
+template<class F>
+constexpr void for_mask_bytes(const Version &v, int mask, F &&f)
+{
+    for (int y = 0, n = 0; y < v.side; ++y) {
+        uint32_t tile = MASK_TILES.rows[mask][y % 12];
 
-    while (pos < n_bits)
-        add_bits(++i & 1 ? 0xec : 0x11, 8, out, pos);
+        tile |= tile << 12;     // Any 8 bits starting from x % 12
 
-    return true;
+        for (int x = 0, offset = 0; x < v.side;) {
+            int len = 8 - (n & 7) < v.side - x ? 8 - (n & 7) : v.side - x;
+            uint8_t bits = ((tile >> offset) & ((1 << len) - 1)) << (n & 7);
+
+            f(n >> 3, uint8_t(bits & ~v.patterns[n >> 3]));
+            x += len;
+            n += len;
+            offset += len;
+            if (offset >= 12)
+                offset -= 12;
+        }
+    }
 }
 
-template<int V>
-void Qr<V>::encode_ecc(const uint8_t *data, Ecc ecc, uint8_t *out)
+// Call f(coord) for every data module in placement order: columns of two modules from right to 
+// left, skipping vertical timing pattern, upwards and downwards in turn, right module first. 
+// Function modules are skipped, so n-th call is for n-th bit of codewords.
+template<class F>
+constexpr void for_data_modules(const Version &v, F &&f)
 {
-    int n_blocks        = N_ECC_BLOCKS[ecc][V];
-    int ecc_len         = ECC_CODEWORDS_PER_BLOCK[ecc][V];
+    for (int x = v.side - 1; x >= 1; x -= 2) {
 
-    int n_data_bytes    = N_DAT_CAPACITY - ecc_len * n_blocks;
+        if (x == 6)
+            x = 5;
 
-    int n_short_blocks  = n_blocks - N_DAT_CAPACITY % n_blocks;
-    int short_len       = N_DAT_CAPACITY / n_blocks - ecc_len;
+        for (int i = 0; i < v.side; ++i) {
 
-    uint8_t gen_poly[30];
-    uint8_t ecc_buf[30];
+            int y = !((x + 1) & 2) ? v.side - 1 - i : i;
 
-    gf_gen_poly(ecc_len, gen_poly);
+            for (int coord = y * v.side + x; coord >= y * v.side + x - 1; --coord) {
+                if (!get_arr_bit(v.patterns, coord))
+                    f(coord);
+            }
+        }
+    }
+}
 
-    const uint8_t *data_ptr = data;
+// Penalty scoring of read-only `code` of any version described by `v`.
+struct Scorer {
+    const Version &v;
+    const uint8_t *code;
 
-    for (int i = 0; i < n_blocks; ++i) {
+    template<bool Horizontal>
+    int  rule_1_3_score(int step) const;
+    int  penalty_score(int step) const;
+    int  penalty_score_packed() const;
+};
+
+// Encoder and decoder working on `code` of any version described by `v`. Qr<V> 
+// is a thin wrapper around it, which provides storage of right size.
+struct Kernel {
+    const Version &v;
+    uint8_t *code;
+
+    void encode_symbol(const uint8_t *data, uint8_t *data_with_ecc, Ecc ecc, int mask);
+    void place(const uint8_t *data_with_ecc);
+    void add_mask(Ecc ecc, int mask);
+    bool encode_data(const Span *spans, size_t n, Ecc ecc, uint8_t *out, size_t pos = 0);
+    void encode_ecc(const uint8_t *data, Ecc ecc, uint8_t *out);
+    bool encode_structured(const char *str, size_t len, Ecc ecc, int index, int total, uint8_t parity, 
+        int mask, uint8_t *data, uint8_t *data_with_ecc);
+
+    int  decode(char *out, size_t max_len, uint8_t *data, uint8_t *data_with_ecc);
+    int  decode_data(const uint8_t *data, Ecc ecc, char *out, size_t max_len);
+    bool decode_ecc(const uint8_t *data, Ecc ecc, uint8_t *out);
+    bool read_format(Ecc &ecc, int &mask);
+    bool read_version();
+    void read_data(uint8_t *out);
+
+    void add_data(const uint8_t *data);
+    void add_format(Ecc ecc, int mask);
+
+    int  select_mask(Ecc ecc, int step);
+    void apply_mask(int mask);
+};
+
+// Turn data codewords into finished code. `data_with_ecc` is zeroed scratch buffer of 
+// n_dat_bytes bytes.
+inline void Kernel::encode_symbol(const uint8_t *data, uint8_t *data_with_ecc, Ecc ecc, int mask)
+{
+    encode_ecc(data, ecc, data_with_ecc);
+    place(data_with_ecc);
+    add_mask(ecc, mask);
+}
+
+// Copy skeleton and place codewords on it.
+inline void Kernel::place(const uint8_t *data_with_ecc)
+{
+    memcpy(code, v.skeleton, v.n_bytes);
+
+    add_data(data_with_ecc);
+}
+
+// Select mask according to policy, add format information and apply mask.
+inline void Kernel::add_mask(Ecc ecc, int mask)
+{
+    if (mask == MASK_AUTO)
+        mask = select_mask(ecc, v.side <= 63 ? 0 : 1);
+    else if (mask == MASK_FAST)
+        mask = select_mask(ecc, v.sample_step);
+    else
+        mask &= 7;
+
+    add_format(ecc, mask);
+    apply_mask(mask);
+}
+
+inline bool Kernel::encode_data(const Span *spans, size_t n, Ecc ecc, uint8_t *out, size_t pos)
+{
+    Mode mode = select_mode(spans, n);
+
+    size_t n_bits = v.data_capacity(ecc);
+    size_t len = 0;
+
+    for (size_t i = 0; i < n; ++i)
+        len += spans[i].len;
+
+    if (pos + 4 + cci(v.ver, mode) + data_bits(mode, len) > n_bits)
+        return false;
+
+    add_bits(1 << mode, 4, out, pos);
+    add_bits(mode == M_KANJI ? len / 2 : len, cci(v.ver, mode), out, pos);
+
+    // Numeric triplets, alphanumeric and kanji pairs may cross span boundaries, 
+    // so characters are accumulated until group is complete.
+    uint16_t acc = 0;
+    int cnt = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+
+        const char *data = spans[i].str;
+
+        for (size_t j = 0; j < spans[i].len; ++j) {
+
+            if (mode == M_NUMERIC) {
+
+                acc = acc * 10 + data[j] - '0';
+                if (++cnt == 3) {
+                    add_bits(acc, 10, out, pos);
+                    acc = cnt = 0;
+                }
+            } else if (mode == M_ALPHANUMERIC) {
+
+                acc = acc * 45 + alphanumeric(data[j]);
+                if (++cnt == 2) {
+                    add_bits(acc, 11, out, pos);
+                    acc = cnt = 0;
+                }
+            } else if (mode == M_BYTE) {
+
+                add_bits(data[j], 8, out, pos);
+
+            } else {
+
+                acc |= uint8_t(data[j]) << (8 * cnt);
+                if (++cnt == 2) {
+                    uint16_t res = 0;
+                    acc -= acc <= 0x9FFC ? 0x8140 : 0xC140;
+                    res += acc & 0xff;
+                    res += (acc >> 8) * 0xc0;
+                    add_bits(res, 13, out, pos);
+                    acc = cnt = 0;
+                }
+            }
+        }
+    }
+
+    if (cnt && mode == M_NUMERIC)
+        add_bits(acc, cnt == 2 ? 7 : 4, out, pos);
+    if (cnt && mode == M_ALPHANUMERIC)
+        add_bits(acc, 6, out, pos);
+
+    size_t padding = n_bits - pos;
+    size_t i = 0;
+
+    add_bits(0, padding > 4 ? 4 : padding, out, pos);
+    
+    if (pos & 7)
+        add_bits(0, (8 - pos) & 7, out, pos);
+
+    while (pos < n_bits)
+        add_bits(++i & 1 ? 0xec : 0x11, 8, out, pos);
+
+    return true;
+}
+
+inline void Kernel::encode_ecc(const uint8_t *data, Ecc ecc, uint8_t *out)
+{
+    int n_blocks        = N_ECC_BLOCKS[ecc][v.ver];
+    int ecc_len         = ECC_CODEWORDS_PER_BLOCK[ecc][v.ver];
+
+    int n_data_bytes    = v.n_dat_capacity - ecc_len * n_blocks;
+
+    int n_short_blocks  = n_blocks - v.n_dat_capacity % n_blocks;
+    int short_len       = v.n_dat_capacity / n_blocks - ecc_len;
+
+    uint8_t gen_poly[30];
+    uint8_t ecc_buf[30];
+
+    gf_gen_poly(ecc_len, gen_poly);
+
+    const uint8_t *data_ptr = data;
+
+    for (int i = 0; i < n_blocks; ++i) {
 
         int data_len = short_len;
 
@@ -475,226 +1054,260 @@ void Qr<V>::encode_ecc(const uint8_t *data, Ecc ecc, uint8_t *out)
     }
 }
 
-template<int V>
-void Qr<V>::add_data(const uint8_t *data, const uint8_t *patterns)
+// One symbol of Structured Append sequence, see Qr<V>::encode(). `data` and `data_with_ecc` 
+// are zeroed scratch buffers of the same size as for encode_symbol().
+inline bool Kernel::encode_structured(const char *str, size_t len, Ecc ecc, int index, int total, 
+    uint8_t parity, int mask, uint8_t *data, uint8_t *data_with_ecc)
 {
-    int data_pos = 0;
+    Span span = { str, len };
+    size_t pos = 0;
 
-    for (int x = SIDE - 1; x >= 1; x -= 2) {
+    if (index < 0 || index >= total || total > 16)
+        return false;
 
-        if (x == 6)
-            x = 5;
+    add_bits(0b0011, 4, data, pos);
+    add_bits(index, 4, data, pos);
+    add_bits(total - 1, 4, data, pos);
+    add_bits(parity, 8, data, pos);
 
-        for (int i = 0; i < SIDE; ++i) {
+    if (!encode_data(&span, 1, ecc, data, pos))
+        return false;
 
-            int y = !((x + 1) & 2) ? SIDE - 1 - i : i;
-            int coord = y * SIDE + x;
+    encode_symbol(data, data_with_ecc, ecc, mask);
+    return true;
+}
 
-            if (!get_arr_bit(patterns, coord)) {
+// Read format and version information, unmask and deinterleave codewords, correct 
+// errors and parse payload into `out`. Return length of payload or -1 on failure.
+// `data` and `data_with_ecc` are zeroed scratch buffers of n_dat_bytes bytes.
+inline int Kernel::decode(char *out, size_t max_len, uint8_t *data, uint8_t *data_with_ecc)
+{
+    Ecc ecc  = L;
+    int mask = 0;
 
-                if (get_bit_r(data, data_pos))
-                    set_arr_bit(code, coord);
-                
-                ++data_pos;
-            }
+    if (!read_format(ecc, mask) || !read_version())
+        return -1;
 
-            if (!get_arr_bit(patterns, coord - 1)) {
+    apply_mask(mask);
+    read_data(data_with_ecc);
 
-                if (get_bit_r(data, data_pos))
-                    set_arr_bit(code, coord - 1);
-                
-                ++data_pos;
-            }
-        }
-    }
+    if (!decode_ecc(data_with_ecc, ecc, data))
+        return -1;
+
+    return decode_data(data, ecc, out, max_len);
 }
 
-template<int V>
-void Qr<V>::add_patterns()
+inline int Kernel::decode_data(const uint8_t *data, Ecc ecc, char *out, size_t max_len)
 {
-    // White bounds inside finders
-    draw_bound<false>(1, 1, 5, 5, code);
-    draw_bound<false>(1, SIDE - 6, 5, 5, code);
-    draw_bound<false>(SIDE - 6, 1, 5, 5, code);
+    constexpr char alnum[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:";
 
-    // Finish alignment patterns
-    for (int i = 0; i < N_ALIGN; ++i) {
-        for (int j = 0; j < N_ALIGN; ++j) {
-            if ((!i && !j) || 
-                (!i && j == N_ALIGN - 1) || 
-                (!j && i == N_ALIGN - 1) )
-                continue;
-            draw_bound<false>(ALIGN_POS[V][i] - 1, ALIGN_POS[V][j] - 1, 3, 3, code);
+    size_t n_bits = v.data_capacity(ecc);
+    size_t pos = 0;
+    size_t len = 0;
+
+    while (pos + 4 <= n_bits) {
+
+        Mode mode;
+
+        switch (get_bits(data, 4, pos)) {
+            case 0: return len;
+            case 3: pos += 16; continue; // Structured Append header
+            case 1: mode = M_NUMERIC;       break;
+            case 2: mode = M_ALPHANUMERIC;  break;
+            case 4: mode = M_BYTE;          break;
+            case 8: mode = M_KANJI;         break;
+            default: return -1;
         }
-    }
 
-    // Draw white separators
-    draw_rect<false>(7, 0, 1, 8, code);
-    draw_rect<false>(0, 7, 8, 1, code);
-    draw_rect<false>(SIDE - 8, 0, 1, 8, code);
-    draw_rect<false>(SIDE - 8, 7, 8, 1, code);
-    draw_rect<false>(7, SIDE - 8, 1, 8, code);
-    draw_rect<false>(0, SIDE - 8, 8, 1, code);
+        if (pos + cci(v.ver, mode) > n_bits)
+            return -1;
 
-    // Perforate timing patterns
-    for (int i = 7; i < SIDE - 7; i += 2) {
-        clr_arr_bit(code, 6 * SIDE + i);
-        clr_arr_bit(code, i * SIDE + 6);
-    }
-}
+        size_t cnt = get_bits(data, cci(v.ver, mode), pos);
 
-template<int V>
-void Qr<V>::add_version()
-{
-    if (V < 7)
-        return;
+        if (mode == M_NUMERIC) {
 
-    uint32_t rem = V;
+            if (pos + 10 * (cnt / 3) + (cnt % 3 == 2 ? 7 : cnt % 3 == 1 ? 4 : 0) > n_bits || len + cnt > max_len)
+                return -1;
 
-    for (uint8_t i = 0; i < 12; ++i)
-        rem = (rem << 1) ^ ((rem >> 11) * 0x1F25);
+            for (size_t i = 0; i < cnt; i += 3) {
+                int n = cnt - i < 3 ? cnt - i : 3;
+                int num = get_bits(data, n == 3 ? 10 : n == 2 ? 7 : 4, pos);
+                for (int j = n - 1; j >= 0; --j, num /= 10)
+                    out[len + j] = '0' + num % 10;
+                if (num)
+                    return -1;
+                len += n;
+            }
+        } else if (mode == M_ALPHANUMERIC) {
 
-    uint32_t data = V << 12 | rem;
-    
-    for (int x = 0; x < 6; ++x) {
-        for (int j = 0; j < 3; ++j) {
+            if (pos + 11 * (cnt / 2) + 6 * (cnt & 1) > n_bits || len + cnt > max_len)
+                return -1;
 
-            int y = SIDE - 11 + j;
+            for (size_t i = 0; i + 1 < cnt; i += 2) {
+                int num = get_bits(data, 11, pos);
+                if (num >= 45 * 45)
+                    return -1;
+                out[len++] = alnum[num / 45];
+                out[len++] = alnum[num % 45];
+            }
+            if (cnt & 1) {
+                int num = get_bits(data, 6, pos);
+                if (num >= 45)
+                    return -1;
+                out[len++] = alnum[num];
+            }
+        } else if (mode == M_BYTE) {
 
-            bool black = (data >> (x * 3 + j)) & 1;
+            if (pos + cnt * 8 > n_bits || len + cnt > max_len)
+                return -1;
 
-            if (!black) {
-                clr_arr_bit(code, y * SIDE + x);
-                clr_arr_bit(code, y + SIDE * x);
+            for (size_t i = 0; i < cnt; ++i)
+                out[len++] = get_bits(data, 8, pos);
+
+        } else {
+
+            if (pos + cnt * 13 > n_bits || len + cnt * 2 > max_len)
+                return -1;
+
+            for (size_t i = 0; i < cnt; ++i) {
+                uint16_t res = get_bits(data, 13, pos);
+                uint16_t val = (res / 0xc0) << 8 | res % 0xc0;
+                val += val < 0x1f00 ? 0x8140 : 0xc140;
+                out[len++] = val & 0xff;
+                out[len++] = val >> 8;
             }
         }
     }
+    return len;
 }
 
-template<int V>
-void Qr<V>::add_format(Ecc ecc, int mask)
+// Reverse of encode_ecc(). Deinterleave blocks, correct them and join data codewords.
+inline bool Kernel::decode_ecc(const uint8_t *data, Ecc ecc, uint8_t *out)
 {
-    int data = (ecc ^ 1) << 3 | mask;
-    int rem = data;
+    int n_blocks        = N_ECC_BLOCKS[ecc][v.ver];
+    int ecc_len         = ECC_CODEWORDS_PER_BLOCK[ecc][v.ver];
 
-    for (int i = 0; i < 10; i++)
-        rem = (rem << 1) ^ ((rem >> 9) * 0b10100110111);
+    int n_data_bytes    = v.n_dat_capacity - ecc_len * n_blocks;
 
-    int res = (data << 10 | rem) ^ 0b101010000010010;
+    int n_short_blocks  = n_blocks - v.n_dat_capacity % n_blocks;
+    int short_len       = v.n_dat_capacity / n_blocks - ecc_len;
 
-    for (int i = 0; i < 6; ++i) {
-        if ((res >> i) & 1) {
-            set_arr_bit(code, SIDE * 8 + SIDE - 1 - i);
-            set_arr_bit(code, SIDE * i + 8);
-        } else {
-            clr_arr_bit(code, SIDE * 8 + SIDE - 1 - i);
-            clr_arr_bit(code, SIDE * i + 8);
-        }
-    }
+    int max_errors      = (ecc_len - misdecode_codewords(v.ver, ecc)) / 2;
 
-    for (int i = 6; i < 8; ++i) {
-        if ((res >> i) & 1) {
-            set_arr_bit(code, SIDE * 8 + SIDE - 1 - i);
-            set_arr_bit(code, SIDE * (i + 1) + 8);
-        } else {
-            clr_arr_bit(code, SIDE * 8 + SIDE - 1 - i);
-            clr_arr_bit(code, SIDE * (i + 1) + 8);
+    uint8_t block[255]; // Reed-Solomon block over GF(256) never exceeds 255 codewords
+
+    uint8_t *out_ptr = out;
+
+    for (int i = 0; i < n_blocks; ++i) {
+
+        int data_len = short_len;
+
+        if (i >= n_short_blocks)
+            ++data_len;
+
+        for (int j = 0, k = i; j < data_len; ++j, k += n_blocks) {
+            if (j == short_len)
+                k -= n_short_blocks;
+            block[j] = data[k];
         }
+        for (int j = 0, k = n_data_bytes + i; j < ecc_len; ++j, k += n_blocks)
+            block[data_len + j] = data[k];
+
+        if (gf_rs_correct(block, data_len + ecc_len, ecc_len, max_errors) < 0)
+            return false;
+
+        memcpy(out_ptr, block, data_len);
+
+        out_ptr += data_len;
     }
+    return true;
+}
 
-    if ((res >> 8) & 1) {
-        set_arr_bit(code, SIDE * 8 + 7);
-        set_arr_bit(code, SIDE * (SIDE - 7) + 8);
-    } else {
-        clr_arr_bit(code, SIDE * 8 + 7);
-        clr_arr_bit(code, SIDE * (SIDE - 7) + 8); 
+// Read both copies of format information and pick the closest valid one.
+inline bool Kernel::read_format(Ecc &ecc, int &mask)
+{
+    int a = 0;
+    int b = 0;
+
+    for (int i = 0; i < 15; ++i) {
+        a |= get_arr_bit(code, format_coord(v.side, i, false)) << i;
+        b |= get_arr_bit(code, format_coord(v.side, i, true)) << i;
     }
 
-    for (int i = 9, j = 5; i < 15; ++i, --j) {
-        if ((res >> i) & 1) {
-            set_arr_bit(code, SIDE * 8 + j);
-            set_arr_bit(code, SIDE * (SIDE - 1 - j) + 8);
-        } else {
-            clr_arr_bit(code, SIDE * 8 + j);
-            clr_arr_bit(code, SIDE * (SIDE - 1 - j) + 8);
+    int best = 4;
+
+    for (int i = 0; i < 32; ++i) {
+        int bits = format_bits(Ecc(i >> 3), i & 7);
+        int dist = popcount(bits ^ a) < popcount(bits ^ b) ? popcount(bits ^ a) : popcount(bits ^ b);
+        if (dist < best) {
+            best = dist;
+            ecc  = Ecc(i >> 3);
+            mask = i & 7;
         }
     }
+    return best < 4;
 }
 
-template<int V>
-template<bool B>
-void Qr<V>::draw_rect(int y, int x, int height, int width, uint8_t *out)
+// Check that at least one copy of version information matches descriptor.
+inline bool Kernel::read_version()
 {
-    if (B) {
-        for (int dy = y * SIDE; dy < (y + height) * SIDE; dy += SIDE)
-            for (int dx = x; dx < x + width; ++dx) 
-                set_arr_bit(out, dy + dx);
-    } else {
-        for (int dy = y * SIDE; dy < (y + height) * SIDE; dy += SIDE)
-            for (int dx = x; dx < x + width; ++dx)
-                clr_arr_bit(out, dy + dx);
+    if (v.ver < 7)
+        return true;
+
+    uint32_t a = 0;
+    uint32_t b = 0;
+
+    for (int x = 0; x < 6; ++x) {
+        for (int j = 0; j < 3; ++j) {
+            int y = v.side - 11 + j;
+            a |= uint32_t(get_arr_bit(code, y * v.side + x)) << (x * 3 + j);
+            b |= uint32_t(get_arr_bit(code, y + v.side * x)) << (x * 3 + j);
+        }
     }
+    return  popcount(a ^ version_bits(v.ver)) < 4 || 
+            popcount(b ^ version_bits(v.ver)) < 4;
 }
 
-template<int V>
-template<bool B>
-void Qr<V>::draw_bound(int y, int x, int height, int width, uint8_t *out)
+// Reverse of add_data(). Collect unmasked data modules into codewords.
+inline void Kernel::read_data(uint8_t *out)
 {
-    if (B) {
-        for (int i = y * SIDE + x;              i < y * SIDE + x+width;                 ++i)
-            set_arr_bit(out, i);
-        for (int i = (y+height-1) * SIDE + x;   i < (y+height-1) * SIDE + x+width;      ++i)
-            set_arr_bit(out, i);
-        for (int i = (y+1) * SIDE + x;          i < (y+height-1) * SIDE + x;            i += SIDE)
-            set_arr_bit(out, i);
-        for (int i = (y+1) * SIDE + x+width-1;  i < (y+height-1) * SIDE + x+width-1;    i += SIDE)
-            set_arr_bit(out, i);
-    } else {
-        for (int i = y * SIDE + x;              i < y * SIDE + x+width;                 ++i)
-            clr_arr_bit(out, i);
-        for (int i = (y+height-1) * SIDE + x;   i < (y+height-1) * SIDE + x+width;      ++i)
-            clr_arr_bit(out, i);
-        for (int i = (y+1) * SIDE + x;          i < (y+height-1) * SIDE + x;            i += SIDE)
-            clr_arr_bit(out, i);
-        for (int i = (y+1) * SIDE + x+width-1;  i < (y+height-1) * SIDE + x+width-1;    i += SIDE)
-            clr_arr_bit(out, i);
-    }
+    size_t data_pos = 0;
+
+    for_data_modules(v, [&](int coord) { add_bits(get_arr_bit(code, coord), 1, out, data_pos); });
 }
 
-template<int V>
-void Qr<V>::reserve_patterns(uint8_t *out)
+// Place data modules in zigzag order, see for_data_modules().
+inline void Kernel::add_data(const uint8_t *data)
 {
-    draw_rect<true>(0, 6, SIDE, 1, out);
-    draw_rect<true>(6, 0, 1, SIDE, out);
-    
-    draw_rect<true>(0, 0, 9, 9, out);
-    draw_rect<true>(SIDE - 8, 0, 8, 9, out);
-    draw_rect<true>(0, SIDE - 8, 9, 8, out);
+    int data_pos = 0;
 
-    for (int i = 0; i < N_ALIGN; ++i) {
-        for (int j = 0; j < N_ALIGN; ++j) {
-            if ((!i && !j) || 
-                (!i && j == N_ALIGN - 1) || 
-                (!j && i == N_ALIGN - 1) )
-                continue;
-            draw_rect<true>(ALIGN_POS[V][i] - 2, ALIGN_POS[V][j] - 2, 5, 5, out);
-        }
-    }
+    for_data_modules(v, [&](int coord) { code[coord >> 3] |= get_bit_r(data, data_pos++) << (coord & 7); });
+}
 
-    if (V >= 7) {
-        draw_rect<true>(SIDE - 11, 0, 3, 6, out);
-        draw_rect<true>(0, SIDE - 11, 6, 3, out);
+inline void Kernel::add_format(Ecc ecc, int mask)
+{
+    int res = format_bits(ecc, mask);
+
+    for (int i = 0; i < 15; ++i) {
+        if ((res >> i) & 1) {
+            set_arr_bit(code, format_coord(v.side, i, false));
+            set_arr_bit(code, format_coord(v.side, i, true));
+        } else {
+            clr_arr_bit(code, format_coord(v.side, i, false));
+            clr_arr_bit(code, format_coord(v.side, i, true));
+        }
     }
 }
 
-template<int V>
+// Score of rules 1 and 3 for every `step`-th row or column, scaled to all of them.
 template<bool H>
-int Qr<V>::rule_1_3_score()
+inline int Scorer::rule_1_3_score(int step) const
 {
-    constexpr int y_max  = H ? N_BITS : SIDE;
-    constexpr int x_max  = H ? SIDE : N_BITS;
-    constexpr int y_step = H ? SIDE : 1;
-    constexpr int x_step = H ? 1 : SIDE;
+    const int side   = v.side;
+    const int y_max  = H ? v.n_bits : side;
+    const int x_max  = H ? side : v.n_bits;
+    const int y_step = H ? side * step : step;
+    const int x_step = H ? 1 : side;
     
     int res = 0;
 
@@ -721,91 +1334,677 @@ int Qr<V>::rule_1_3_score()
             }
         }
     }
-    return res;
+    return res * step;
 }
 
-template<int V>
-int Qr<V>::penalty_score()
+// Penalty score of rules 1, 2 and 3 on every `step`-th row and column, scaled to all of them,
+// and rule 4 on all modules. Step 1 gives exact score. MASK_FAST uses sample_step of 2 for 
+// V12-13 and 3 after: mean penalty of picked mask is within 3 % of the best, worst within 35 %.
+inline int Scorer::penalty_score(int step) const
 {
+    const int side   = v.side;
+    const int n_bits = v.n_bits;
+
     int res = 0;
 
-    res += rule_1_3_score<true>();
-    res += rule_1_3_score<false>();
+    res += rule_1_3_score<true>(step);
+    res += rule_1_3_score<false>(step);
 
-    for (int y = 0; y < N_BITS - SIDE; y += SIDE) {
-        for (int x = 0; x < SIDE - 1; ++x) {
+    for (int y = 0; y < n_bits - side; y += side * step) {
+        for (int x = 0; x < side - 1; ++x) {
 
             bool c = get_arr_bit(code, y + x);
 
             if (c == get_arr_bit(code, y + x + 1)  &&
-                c == get_arr_bit(code, y + x + SIDE) &&
-                c == get_arr_bit(code, y + x + SIDE + 1))
-                res += 3;
+                c == get_arr_bit(code, y + x + side) &&
+                c == get_arr_bit(code, y + x + side + 1))
+                res += 3 * step;
         }
     }
 
     int black = 0;
-    for (int y = 0; y < N_BITS; y += SIDE) {
-        for (int x = 0; x < SIDE; ++x)
-            black += get_arr_bit(code, y + x);
+    for (int i = 0; i < v.n_bytes; ++i)
+        black += popcount(code[i]);
+    res += abs((black * 100) / n_bits - 50) / 5 * 10;
+
+    return res;
+}
+
+// Rules 1 and 3 for line of n modules packed into word, bit x is module x. Finder-like 
+// patterns are counted if they start from module `finder_from` or further.
+constexpr int line_penalty(uint64_t line, int n, int finder_from)
+{
+    const uint64_t valid = ~0ull >> (64 - n);
+
+    uint64_t eq    = ~(line ^ (line >> 1));                     // Module x equals x + 1
+    uint64_t run   = eq & (eq >> 1) & (eq >> 2) & (eq >> 3) & (valid >> 4);
+    uint64_t start = ~(eq << 1);                                // Module x - 1 differs
+
+    uint64_t a = valid >> 10 & (~0ull << finder_from);
+    uint64_t b = a;
+
+    for (int k = 0; k < 11; ++k) {
+        uint64_t m = line >> k;
+        a &= (0x05d >> (10 - k)) & 1 ? m : ~m;
+        b &= (0x5d0 >> (10 - k)) & 1 ? m : ~m;
+    }
+    return popcount64(run) + 2 * popcount64(run & start) + 40 * popcount64(a | b);
+}
+
+// Exact penalty_score(1) for versions with side up to 63. Rows and columns are packed into 
+// 64-bit words, so each rule is counted for the whole line at once. Columns are formed the 
+// same way rule_1_3_score() scans them: first module of column, then the next column.
+inline int Scorer::penalty_score_packed() const
+{
+    const int side = v.side;
+    const uint64_t valid = ~0ull >> (64 - side);
+
+    uint64_t rows[64] = {};
+    uint64_t cols[64] = {};
+
+    for (int y = 0; y < side; ++y)
+        rows[y] = cols[y] = get_arr_bits(code, y * side, side);
+    transpose_64x64(cols);
+
+    int res = 0;
+    int black = 0;
+
+    for (int y = 0; y < side; ++y) {
+        uint64_t col = (cols[y] & 1) | (y < side - 1 ? cols[y + 1] << 1 : cols[0] & ~1ull);
+
+        res += line_penalty(rows[y], side, 0);
+        res += line_penalty(col, side + 1, 1);
+        black += popcount64(rows[y]);
+
+        if (y < side - 1) {
+            uint64_t a = rows[y];
+            uint64_t b = rows[y + 1];
+            res += 3 * popcount64(~(a ^ (a >> 1)) & ~(a ^ b) & ~(a ^ (b >> 1)) & (valid >> 1));
+        }
     }
-    res += abs((black * 100) / N_BITS - 50) / 5 * 10;
+    res += abs((black * 100) / v.n_bits - 50) / 5 * 10;
 
     return res;
 }
 
-template<int V>
-int Qr<V>::select_mask(Ecc ecc, const uint8_t *patterns)
+inline int Kernel::select_mask(Ecc ecc, int step)
 {
+    const Scorer scorer = { v, code };
     unsigned min_score = -1;
     unsigned score = 0;
     uint8_t mask = 0;
 
     for (int i = 0; i < 8; ++i) {
         add_format(ecc, i);
-        apply_mask(i, patterns);
-        score = penalty_score();
+        apply_mask(i);
+        score = step ? scorer.penalty_score(step) : scorer.penalty_score_packed();
         if (score < min_score) {
             mask = i;
             min_score = score;
         }
-        apply_mask(i, patterns);
+        apply_mask(i);
     }
     return mask;
 }
 
+// XOR data modules with mask. Applying the same mask twice restores code.
+inline void Kernel::apply_mask(int mask)
+{
+    for_mask_bytes(v, mask, [this](int i, uint8_t bits) { code[i] ^= bits; });
+}
+
+template<int V>
+struct Qr;
+
+// Data codewords, output of encode_data() stage.
+template<int V>
+struct Data {
+    uint8_t codewords[VERSION<V>.n_dat_bytes] = {};
+    Ecc ecc     = L;
+    int mask    = MASK_AUTO;
+};
+
+// Data codewords interleaved with Ecc codewords, output of encode_ecc() stage.
+template<int V>
+struct Codewords {
+    uint8_t codewords[VERSION<V>.n_dat_bytes] = {};
+    Ecc ecc     = L;
+    int mask    = MASK_AUTO;
+};
+
+template<int V>
+int verify(const uint8_t *grid, char *out, size_t max_len);
+
+template<int V>
+int verify(const Qr<V> &qr, char *out, size_t max_len);
+
+template<int V>
+void add_data(const Codewords<V> &in, Qr<V> &out);
+
+template<int V>
+void add_mask(Qr<V> &qr, Ecc ecc, int mask);
+
+template<int V>
+struct Qr {
+    constexpr auto side_size() const { return SIDE; }
+    bool module(int x, int y) const;
+    bool encode(const char *str, size_t len, Ecc ecc, int mask = -1);
+    bool encode(const Span *spans, size_t n, Ecc ecc, int mask = -1);
+    bool encode(std::initializer_list<Span> spans, Ecc ecc, int mask = -1);
+    bool encode(const char *str, size_t len, Ecc ecc, int index, int total, uint8_t parity, int mask = -1);
+    static constexpr size_t data_capacity(Ecc ecc);
+    int  penalty_score() const;
+private:
+    int  decode(char *out, size_t max_len);
+private:
+    static_assert(V >= 1 && V <= 40, "invalid version");
+    static constexpr int SIDE           = VERSION<V>.side;
+    static constexpr int N_BYTES        = VERSION<V>.n_bytes;
+    static constexpr int N_DAT_BYTES    = VERSION<V>.n_dat_bytes;
+private:
+    uint8_t code[N_BYTES] = {};
+    bool status = false;
+
+    template<int U>
+    friend int verify(const uint8_t *grid, char *out, size_t max_len);
+    template<int U>
+    friend int verify(const Qr<U> &qr, char *out, size_t max_len);
+    template<int U>
+    friend void add_data(const Codewords<U> &in, Qr<U> &out);
+    template<int U>
+    friend void add_mask(Qr<U> &qr, Ecc ecc, int mask);
+    template<int U>
+    friend class Batch;
+};
+
+// Get color of a module from left-to-right and top-to-bottom. Black is true.
+template<int V>
+bool Qr<V>::module(int x, int y) const
+{
+    return get_arr_bit(code, y * SIDE + x);
+}
+
+// Create Qr code with given error correction level. If mask == MASK_AUTO (-1), 
+// then best mask selected automatically. NOTE: Automatic mask is the 
+// most expensive operation. Takes about 95 % of all computation time. 
+// MASK_FAST picks mask cheaper, see MaskPolicy and Scorer::penalty_score().
 template<int V>
-void Qr<V>::apply_mask(int mask, const uint8_t *patterns)
+bool Qr<V>::encode(const char *str, size_t len, Ecc ecc, int mask)
 {
-    for (int y = 0, dy = 0; y < SIDE; ++y, dy += SIDE) {
-        for (int x = 0; x < SIDE; ++x) {
+    Span span = { str, len };
 
-            int coord = dy + x;
+    return encode(&span, 1, ecc, mask);
+}
 
-            if (get_arr_bit(patterns, coord))
-                continue;
+// Create Qr code from payload split into several spans, e.g. prefix, serial number and 
+// checksum, without joining them into temporary buffer. Spans are encoded in one segment.
+template<int V>
+bool Qr<V>::encode(const Span *spans, size_t n, Ecc ecc, int mask)
+{
+    uint8_t data[N_DAT_BYTES]           = {};
+    uint8_t data_with_ecc[N_DAT_BYTES]  = {};
+    Kernel kernel = { VERSION<V>, code };
+
+    if (!kernel.encode_data(spans, n, ecc, data)) {
+        return status = false;
+    }
+    kernel.encode_symbol(data, data_with_ecc, ecc, mask);
+
+    return status = true;
+}
+
+template<int V>
+bool Qr<V>::encode(std::initializer_list<Span> spans, Ecc ecc, int mask)
+{
+    return encode(spans.begin(), spans.size(), ecc, mask);
+}
+
+// Create one symbol of Structured Append sequence: `index` of `total` symbols (up to 16), 
+// where `parity` is XOR of all bytes of the whole payload. See encode_structured().
+template<int V>
+bool Qr<V>::encode(const char *str, size_t len, Ecc ecc, int index, int total, uint8_t parity, int mask)
+{
+    uint8_t data[N_DAT_BYTES]           = {};
+    uint8_t data_with_ecc[N_DAT_BYTES]  = {};
+    Kernel kernel = { VERSION<V>, code };
+
+    return status = kernel.encode_structured(str, len, ecc, index, total, parity, mask, data, data_with_ecc);
+}
+
+// Number of bits available for data (without Ecc) with given error correction level.
+template<int V>
+constexpr size_t Qr<V>::data_capacity(Ecc ecc)
+{
+    return VERSION<V>.data_capacity(ecc);
+}
+
+// Exact penalty score of current code.
+template<int V>
+int Qr<V>::penalty_score() const
+{
+    const Scorer scorer = { VERSION<V>, code };
+
+    return SIDE <= 63 ? scorer.penalty_score_packed() : scorer.penalty_score(1);
+}
+
+template<int V>
+int Qr<V>::decode(char *out, size_t max_len)
+{
+    uint8_t data[N_DAT_BYTES]           = {};
+    uint8_t data_with_ecc[N_DAT_BYTES]  = {};
+    Kernel kernel = { VERSION<V>, code };
+
+    return kernel.decode(out, max_len, data, data_with_ecc);
+}
+
+// Decode raw module grid of version V, stored the same way as Qr<V> keeps it: row-major, 
+// bit n of the grid is byte n / 8, bit n % 8 (starting from LSB). Errors are corrected 
+// with Reed-Solomon Ecc. Return length of payload written to `out` or -1 on failure.
+template<int V>
+int verify(const uint8_t *grid, char *out, size_t max_len)
+{
+    Qr<V> qr;
+    memcpy(qr.code, grid, Qr<V>::N_BYTES);
+    return qr.decode(out, max_len);
+}
+
+// Decode encoded Qr code back to payload. Useful to verify every code after encode().
+template<int V>
+int verify(const Qr<V> &qr, char *out, size_t max_len)
+{
+    return verify<V>(qr.code, out, max_len);
+}
+
+// Stages of Qr<V>::encode(), which can run on different threads for a stream of codes: 
+// encode_data() -> encode_ecc() -> add_data() -> add_mask() -> render(). Intermediate 
+// buffers are plain structs, so they can be moved or reused between calls.
+
+// Classify and pack payload into data codewords. Return false if it doesn't fit.
+template<int V>
+bool encode_data(const Span *spans, size_t n, Ecc ecc, int mask, Data<V> &out)
+{
+    Kernel kernel = { VERSION<V>, nullptr };
+
+    memset(out.codewords, 0, sizeof(out.codewords));
+    out.ecc  = ecc;
+    out.mask = mask;
+
+    return kernel.encode_data(spans, n, ecc, out.codewords);
+}
+
+// Compute Ecc codewords and interleave blocks.
+template<int V>
+void encode_ecc(const Data<V> &in, Codewords<V> &out)
+{
+    Kernel kernel = { VERSION<V>, nullptr };
+
+    memset(out.codewords, 0, sizeof(out.codewords));
+    out.ecc  = in.ecc;
+    out.mask = in.mask;
+
+    kernel.encode_ecc(in.codewords, in.ecc, out.codewords);
+}
+
+// Place codewords on skeleton of the code. Result isn't masked yet.
+template<int V>
+void add_data(const Codewords<V> &in, Qr<V> &out)
+{
+    Kernel kernel = { VERSION<V>, out.code };
+
+    kernel.place(in.codewords);
+    out.status = false;
+}
 
-            bool keep = true;
-
-            switch (mask) {
-                case 0: keep =  (x + y) & 1;                    break;
-                case 1: keep =   y & 1;                         break;
-                case 2: keep =   x % 3;                         break;
-                case 3: keep =  (x + y) % 3;                    break;
-                case 4: keep =  (y / 2 + x / 3) & 1;            break;
-                case 5: keep =   x * y  % 2 + x * y % 3;        break;
-                case 6: keep =  (x * y  % 2 + x * y % 3) & 1;   break;
-                case 7: keep = ((x + y) % 2 + x * y % 3) & 1;   break;
+// Select mask according to policy, add format information and apply mask.
+template<int V>
+void add_mask(Qr<V> &qr, Ecc ecc, int mask)
+{
+    Kernel kernel = { VERSION<V>, qr.code };
+
+    kernel.add_mask(ecc, mask);
+    qr.status = true;
+}
+
+// Rasterize code into 8-bit grayscale image with `border` modules of quiet zone, each module 
+// is `scale` x `scale` pixels. Image is square with side (side_size() + 2 * border) * scale.
+template<int V>
+void render(const Qr<V> &qr, uint8_t *out, int scale = 1, int border = 4)
+{
+    const int side = (qr.side_size() + 2 * border) * scale;
+
+    for (int y = 0; y < side; ++y) {
+        for (int x = 0; x < side; ++x) {
+            int my = y / scale - border;
+            int mx = x / scale - border;
+            bool black = my >= 0 && mx >= 0 && my < qr.side_size() && mx < qr.side_size() && qr.module(mx, my);
+            out[y * side + x] = black ? 0 : 255;
+        }
+    }
+}
+
+// Longest prefixes of payload which are numeric, alphanumeric and kanji pairs. Mode that
+// select_mode() picks for any shorter prefix and number of bits it takes follow from them.
+struct ModeRuns {
+    size_t numeric  = 0;
+    size_t alnum    = 0;
+    size_t kanji    = 0;
+
+    constexpr Mode   mode(size_t n) const;
+    constexpr size_t bits(int ver, size_t n) const;
+};
+
+constexpr Mode ModeRuns::mode(size_t n) const
+{
+    if (n <= numeric)
+        return M_NUMERIC;
+    if (n <= alnum)
+        return M_ALPHANUMERIC;
+    if (!(n & 1) && n <= kanji)
+        return M_KANJI;
+    return M_BYTE;
+}
+
+// Bits of segment with first `n` characters, including mode indicator and CCI.
+constexpr size_t ModeRuns::bits(int ver, size_t n) const
+{
+    Mode m = mode(n);
+
+    return 4 + cci(ver, m) + data_bits(m, n);
+}
+
+// Scan at most `len` characters of payload.
+constexpr ModeRuns mode_runs(const char *str, size_t len)
+{
+    ModeRuns r;
+
+    while (r.numeric < len && str[r.numeric] >= '0' && str[r.numeric] <= '9')
+        ++r.numeric;
+
+    r.alnum = r.numeric;
+    while (r.alnum < len && alphanumeric(str[r.alnum]) != -1)
+        ++r.alnum;
+
+    while (r.kanji + 1 < len && is_kanji_pair(str[r.kanji], str[r.kanji + 1]))
+        r.kanji += 2;
+
+    return r;
+}
+
+// Longest prefix of odd or even length up to `max_len`, which fits into `n_bits` of version `ver`,
+// or 0. Bits only grow with length of the same parity, but odd length breaks the last kanji pair,
+// so longer prefix may fit while shorter one doesn't. Hence parities are searched separately.
+constexpr size_t longest_prefix(const ModeRuns &runs, int ver, size_t n_bits, size_t max_len, bool odd)
+{
+    size_t lo = 0;                      // Number of lengths of this parity that fit
+    size_t hi = (max_len + odd) / 2;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi + 1) / 2;
+        if (runs.bits(ver, 2 * mid - odd) <= n_bits)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo ? 2 * lo - odd : 0;
+}
+
+// Piece of payload and version of its code in Structured Append sequence.
+struct Chunk {
+    int ver;
+    size_t len;
+};
+
+// Split payload into Structured Append sequence of at most `max_symbols` (up to 16) codes of
+// versions from `min_ver` to `max_ver`, so that the sum of versions is the least, fewer codes
+// first among equal sums. Return number of chunks or 0 if payload doesn't fit. If 1 is returned,
+// the code should be encoded without header.
+//
+// Searched by increasing sum: for each number of codes and parity of position (odd position
+// splits kanji pairs differently) only the furthest covered position is kept, since the rest
+// of payload from there never takes more bits. Each code takes the longest chunk it fits.
+inline int split_structured(const char *str, size_t len, Ecc ecc, int min_ver, int max_ver, Chunk *chunks,
+    int max_symbols)
+{
+    constexpr int MAX_SUM = 16 * 40;
+
+    if (max_symbols > 16)
+        max_symbols = 16;
+    if (max_symbols < 1 || min_ver < 1 || max_ver > 40 || min_ver > max_ver)
+        return 0;
+
+    size_t n_bits[41] = {};
+
+    for (int v = min_ver; v <= max_ver; ++v)
+        n_bits[v] = make_version(v).data_capacity(ecc);
+
+    // Numeric mode is the densest, so no chunk is longer
+    const size_t max_chunk = n_bits[max_ver] * 3 / 10 + 2;
+
+    if (len > max_chunk * max_symbols)
+        return 0;
+
+    auto runs_from = [&](size_t pos) {
+        return mode_runs(str + pos, len - pos < max_chunk ? len - pos : max_chunk);
+    };
+
+    // The smallest single code without header
+    int best = MAX_SUM + 1;
+
+    if (len <= max_chunk) {
+        ModeRuns runs = runs_from(0);
+        for (int v = max_ver; v >= min_ver && runs.bits(v, len) <= n_bits[v]; --v)
+            best = v;
+    }
+    const int single = best <= max_ver ? best : 0;
+
+    // reach[s % 64][k][p] is the furthest position of parity p covered by k codes with sum of
+    // versions s, or -1. from[s][k][p] holds version of the last of them and parity before it.
+    // front[k][p] is the furthest position covered by at most k codes with smaller or equal sum, 
+    // states which don't go beyond it aren't expanded.
+    int reach[64][17][2];
+    int front[17][2];
+    uint8_t from[MAX_SUM + 1][17][2];
+    int end_sum = 0;
+    int end_cnt = 0;
+    int end_par = 0;
+
+    for (auto &r : reach) {
+        for (auto &k : r)
+            k[0] = k[1] = -1;
+    }
+    for (auto &k : front)
+        k[0] = k[1] = -1;
+    reach[0][0][0] = 0;
+
+    for (int s = 0; s < best && !end_cnt; ++s) {
+
+        int (*cur)[2] = reach[s & 63];
+
+        for (int k = 1; k <= max_symbols && !end_cnt; ++k) {
+            for (int p = 0; p < 2; ++p) {
+                if (cur[k][p] == int(len)) {
+                    end_sum = s;
+                    end_cnt = k;
+                    end_par = p;
+                    break;
+                }
             }
+        }
+
+        for (int k = 0; k < max_symbols && !end_cnt; ++k) {
+            for (int p = 0; p < 2; ++p) {
+
+                if (cur[k][p] <= front[k][p])
+                    continue;
+                for (int i = k; i <= 16; ++i)
+                    front[i][p] = front[i][p] > cur[k][p] ? front[i][p] : cur[k][p];
 
-            if (!keep) {
-                if (get_arr_bit(code, coord))
-                    clr_arr_bit(code, coord);
-                else
-                    set_arr_bit(code, coord);
+                size_t pos = cur[k][p];
+                size_t max_len = len - pos < max_chunk ? len - pos : max_chunk;
+                ModeRuns runs = runs_from(pos);
+
+                for (int v = min_ver; v <= max_ver && s + v < best; ++v) {
+                    for (int odd = 0; odd < 2; ++odd) {
+
+                        size_t n = longest_prefix(runs, v, n_bits[v] - 20, max_len, odd);
+                        int end = int(pos + n);
+                        int &to = reach[(s + v) & 63][k + 1][end & 1];
+
+                        if (n && end > to) {
+                            to = end;
+                            from[s + v][k + 1][end & 1] = uint8_t(v | p << 6);
+                        }
+                    }
+                }
             }
         }
+
+        // Slot is reused for sum s + 64
+        for (int k = 0; k <= 16; ++k)
+            cur[k][0] = cur[k][1] = -1;
+    }
+
+    if (!end_cnt) {
+        if (single)
+            chunks[0] = { single, len };
+        return single ? 1 : 0;
+    }
+
+    // Walk back to collect versions and parities, then replay chunks from the start
+    int par[17] = {};
+
+    par[end_cnt] = end_par;
+    for (int k = end_cnt, s = end_sum; k > 0; --k) {
+        chunks[k - 1].ver = from[s][k][par[k]] & 63;
+        par[k - 1] = from[s][k][par[k]] >> 6;
+        s -= chunks[k - 1].ver;
+    }
+
+    size_t pos = 0;
+
+    for (int k = 0; k < end_cnt; ++k) {
+        size_t max_len = len - pos < max_chunk ? len - pos : max_chunk;
+        int v = chunks[k].ver;
+
+        chunks[k].len = longest_prefix(runs_from(pos), v, n_bits[v] - 20, max_len, par[k] ^ par[k + 1]);
+        pos += chunks[k].len;
+    }
+    return end_cnt;
+}
+
+// Code of Structured Append sequence of any version. Modules are kept in caller's buffer the
+// same way as Qr<V> keeps them.
+struct Symbol {
+    int ver                 = 0;
+    const uint8_t *modules  = nullptr;
+
+    int  side_size() const          { return 17 + ver * 4; }
+    bool module(int x, int y) const { return get_arr_bit(modules, y * side_size() + x); }
+};
+
+// Descriptor of version `ver` from MinV to MaxV. Only tables of these versions are instantiated.
+template<int MinV, int MaxV>
+const Version& version_of(int ver)
+{
+    static_assert(MinV >= 1 && MinV <= MaxV && MaxV <= 40, "invalid version range");
+
+    if constexpr (MinV < MaxV) {
+        if (ver > MinV)
+            return version_of<MinV + 1, MaxV>(ver);
+    }
+    return VERSION<MinV>;
+}
+
+// Encode `index`-th of `total` chunks of Structured Append sequence into `modules` of version of
+// the chunk. Single chunk is encoded without header.
+template<int MinV, int MaxV>
+bool encode_chunk(const char *str, const Chunk &chunk, Ecc ecc, int index, int total, uint8_t parity,
+    int mask, uint8_t *modules)
+{
+    uint8_t data[VERSION<MaxV>.n_dat_bytes]           = {};
+    uint8_t data_with_ecc[VERSION<MaxV>.n_dat_bytes]  = {};
+    Kernel kernel = { version_of<MinV, MaxV>(chunk.ver), modules };
+    Span span = { str, chunk.len };
+
+    if (total > 1)
+        return kernel.encode_structured(str, chunk.len, ecc, index, total, parity, mask, data, data_with_ecc);
+
+    if (!kernel.encode_data(&span, 1, ecc, data))
+        return false;
+
+    kernel.encode_symbol(data, data_with_ecc, ecc, mask);
+    return true;
+}
+
+// Encode payload into Structured Append sequence of versions from MinV to MaxV, picked by
+// split_structured(). Modules of codes are written one after another into `buf` of `buf_size`
+// bytes, `max_symbols` sizes of Qr<MaxV> is always enough. Return number of codes or 0.
+template<int MinV, int MaxV>
+int encode_structured(const char *str, size_t len, Ecc ecc, Symbol *out, int max_symbols,
+    uint8_t *buf, size_t buf_size, int mask = -1)
+{
+    Chunk chunks[16] = {};
+    int total = split_structured(str, len, ecc, MinV, MaxV, chunks, max_symbols);
+    uint8_t parity = 0;
+    size_t used = 0;
+
+    for (size_t i = 0; i < len; ++i)
+        parity ^= str[i];
+
+    for (int i = 0; i < total; str += chunks[i++].len) {
+
+        const Version &v = version_of<MinV, MaxV>(chunks[i].ver);
+
+        if (used + v.n_bytes > buf_size)
+            return 0;
+        if (!encode_chunk<MinV, MaxV>(str, chunks[i], ecc, i, total, parity, mask, buf + used))
+            return 0;
+
+        out[i] = { v.ver, buf + used };
+        used += v.n_bytes;
     }
+    return total;
+}
+
+// Encode payload into Structured Append sequence of codes of the same version V, which is
+// the least number of codes. See encode_structured() above for sequence of mixed versions.
+// Symbols are encoded one after another, qr_structured.h encodes them on several threads.
+// Return number of symbols used or 0 on failure.
+template<int V>
+int encode_structured(const char *str, size_t len, Ecc ecc, Qr<V> *out, int max_symbols, int mask = -1)
+{
+    Chunk chunks[16] = {};
+    int total = split_structured(str, len, ecc, V, V, chunks, max_symbols);
+
+    if (total == 1)
+        return out[0].encode(str, len, ecc, mask);
+
+    uint8_t parity = 0;
+
+    for (size_t i = 0; i < len; ++i)
+        parity ^= str[i];
+
+    for (int i = 0; i < total; str += chunks[i++].len) {
+        if (!out[i].encode(str, chunks[i].len, ecc, i, total, parity, mask))
+            return 0;
+    }
+    return total;
+}
+
+// Decode code of Structured Append sequence of version from MinV to MaxV, see verify().
+template<int MinV, int MaxV>
+int verify(const Symbol &symbol, char *out, size_t max_len)
+{
+    uint8_t code[VERSION<MaxV>.n_bytes]               = {};
+    uint8_t data[VERSION<MaxV>.n_dat_bytes]           = {};
+    uint8_t data_with_ecc[VERSION<MaxV>.n_dat_bytes]  = {};
+    Kernel kernel = { version_of<MinV, MaxV>(symbol.ver), code };
+
+    if (symbol.ver < MinV || symbol.ver > MaxV)
+        return -1;
+
+    memcpy(code, symbol.modules, kernel.v.n_bytes);
+    return kernel.decode(out, max_len, data, data_with_ecc);
 }
 
 }
@@ -0,0 +1,296 @@
+#ifndef QR_BATCH_H
+#define QR_BATCH_H
+
+#include "qr.h"
+
+namespace qr {
+
+// Encodes up to 64 codes of the same version at once. Codes are bit-sliced: module n of
+// code j is bit j of plane n, so placement, masking and penalty scoring are done for all
+// of them with plain bitwise operations. Data and Ecc codewords are still per code.
+// Holds 64 * n_bytes bytes of planes and 64 * n_dat_bytes of codewords (~0.5 MB for
+// version 40), so it's better to keep it static or on heap.
+template<int V>
+class Batch {
+public:
+    static constexpr int MAX_CODES = 64;
+
+    // Encode payloads[i] into out[i] for i < n (at most MAX_CODES), mask is the same as for
+    // Qr<V>::encode(). Return number of payloads that fit, the rest of codes get no status.
+    int encode(const Span *payloads, int n, Ecc ecc, int mask, Qr<V> *out);
+private:
+    static constexpr int SIDE           = VERSION<V>.side;
+    static constexpr int N_BITS         = VERSION<V>.n_bits;
+    static constexpr int N_BYTES        = VERSION<V>.n_bytes;
+    static constexpr int N_DAT_BYTES    = VERSION<V>.n_dat_bytes;
+    static constexpr int N_CNT_BITS     = 20;   // Width of bit-sliced counters, enough for V40
+
+    using Counter = uint64_t[N_CNT_BITS];
+
+    void load_byte(int i, uint64_t *out) const;
+    void place();
+    void add_format(Ecc ecc, const uint64_t *sel);
+    void apply_mask(int mask, uint64_t sel);
+    template<bool Horizontal>
+    void score_lines(int step, Counter &r1, Counter &r3) const;
+    void score(int step, unsigned *out) const;
+    void select_mask(Ecc ecc, int step, uint64_t active, uint64_t *sel);
+    void store(Qr<V> *out, int n, uint64_t active) const;
+
+    static void add(Counter &cnt, uint64_t e, int shift = 0);
+    static unsigned get(const Counter &cnt, int j);
+private:
+    uint8_t codewords[MAX_CODES][N_DAT_BYTES];
+    uint64_t planes[N_BYTES * 8];
+};
+
+// Add 1 << shift to counters of codes set in `e`.
+template<int V>
+void Batch<V>::add(Counter &cnt, uint64_t e, int shift)
+{
+    for (int k = shift; e && k < N_CNT_BITS; ++k) {
+        uint64_t carry = cnt[k] & e;
+        cnt[k] ^= e;
+        e = carry;
+    }
+}
+
+// Value of counter of j-th code.
+template<int V>
+unsigned Batch<V>::get(const Counter &cnt, int j)
+{
+    unsigned res = 0;
+
+    for (int k = 0; k < N_CNT_BITS; ++k)
+        res |= unsigned((cnt[k] >> j) & 1) << k;
+    return res;
+}
+
+// Bit-sliced i-th codeword of all codes: out[k] holds k-th bit from MSB.
+template<int V>
+void Batch<V>::load_byte(int i, uint64_t *out) const
+{
+    for (int k = 0; k < 8; ++k)
+        out[k] = 0;
+
+    for (int g = 0; g < MAX_CODES / 8; ++g) {
+        uint64_t x = 0;
+        for (int j = 0; j < 8; ++j)
+            x |= uint64_t(codewords[g * 8 + j][i]) << (j * 8);
+
+        x = transpose_8x8(x);
+        for (int k = 0; k < 8; ++k)
+            out[7 - k] |= ((x >> (k * 8)) & 0xff) << (g * 8);
+    }
+}
+
+// Copy skeleton and place codewords on it, see for_data_modules().
+template<int V>
+void Batch<V>::place()
+{
+    const uint8_t *skeleton = VERSION<V>.skeleton;
+
+    for (int i = 0; i < N_BYTES * 8; ++i)
+        planes[i] = -uint64_t(get_arr_bit(skeleton, i));
+
+    uint64_t bits[8];
+    int data_pos = 0;
+
+    for_data_modules(VERSION<V>, [&](int coord) {
+        if (!(data_pos & 7))
+            load_byte(data_pos >> 3, bits);
+        planes[coord] = bits[data_pos & 7];
+        ++data_pos;
+    });
+}
+
+// Add format information, sel[i] has codes which use i-th mask.
+template<int V>
+void Batch<V>::add_format(Ecc ecc, const uint64_t *sel)
+{
+    for (int i = 0; i < 15; ++i) {
+        uint64_t plane = 0;
+
+        for (int mask = 0; mask < 8; ++mask)
+            plane |= -uint64_t((format_bits(ecc, mask) >> i) & 1) & sel[mask];
+
+        planes[format_coord(SIDE, i, false)] = plane;
+        planes[format_coord(SIDE, i, true)]  = plane;
+    }
+}
+
+// XOR data modules of codes in `sel` with mask.
+template<int V>
+void Batch<V>::apply_mask(int mask, uint64_t sel)
+{
+    for_mask_bytes(VERSION<V>, mask, [this, sel](int i, uint8_t bits) {
+        for (int k = 0; bits >> k; ++k)
+            planes[i * 8 + k] ^= -uint64_t((bits >> k) & 1) & sel;
+    });
+}
+
+// Rules 1 and 3 for every `step`-th row or column. Modules are visited in the same order
+// as Scorer::rule_1_3_score() does, so columns go one module right after the first one and
+// have one module more. Counts penalty of runs in r1 and finder-like patterns in r3.
+template<int V>
+template<bool H>
+void Batch<V>::score_lines(int step, Counter &r1, Counter &r3) const
+{
+    const int len    = H ? SIDE : SIDE + 1;
+    const int stride = H ? 1 : SIDE;
+
+    for (int l = 0; l < SIDE; l += step) {
+        const uint64_t *p = planes + l * (H ? SIDE : 1);
+        uint64_t h[11] = {};    // h[k] is module x - k
+        uint64_t e[5]  = {};    // e[k] is set if modules x - k and x - k - 1 are equal
+
+        for (int x = 0; x < len; ++x) {
+            for (int k = 10; k > 0; --k)
+                h[k] = h[k - 1];
+            for (int k = 4; k > 0; --k)
+                e[k] = e[k - 1];
+            h[0] = x ? p[1 + (x - 1) * stride] : p[0];
+            e[0] = ~(h[0] ^ h[1]);
+
+            if (x < 4)
+                continue;
+
+            // Each module of run from 5-th on adds 1, and the 5-th adds 3.
+            uint64_t run = e[0] & e[1] & e[2] & e[3];
+            add(r1, run);
+            add(r1, run & (x == 4 ? ~0ull : ~e[4]), 1);
+
+            if (x < len - SIDE + 10)
+                continue;
+
+            uint64_t finder =
+                ( h[0] & ~h[1] &  h[2] &  h[3] &  h[4] & ~h[5] &  h[6] & ~h[7] & ~h[8] & ~h[9] & ~h[10]) |
+                (~h[0] & ~h[1] & ~h[2] & ~h[3] &  h[4] & ~h[5] &  h[6] &  h[7] &  h[8] & ~h[9] &  h[10]);
+            add(r3, finder);
+        }
+    }
+}
+
+// Penalty score of every code, same as Scorer::penalty_score() with the same step.
+template<int V>
+void Batch<V>::score(int step, unsigned *out) const
+{
+    Counter r1 = {}, r2 = {}, r3 = {}, black = {};
+
+    score_lines<true>(step, r1, r3);
+    score_lines<false>(step, r1, r3);
+
+    for (int y = 0; y < SIDE - 1; y += step) {
+        const uint64_t *p = planes + y * SIDE;
+        for (int x = 0; x < SIDE - 1; ++x) {
+            uint64_t c = p[x];
+            add(r2, ~(c ^ p[x + 1]) & ~(c ^ p[x + SIDE]) & ~(c ^ p[x + SIDE + 1]));
+        }
+    }
+
+    for (int i = 0; i < N_BITS; ++i)
+        add(black, planes[i]);
+
+    for (int j = 0; j < MAX_CODES; ++j) {
+        out[j]  = (get(r1, j) + 3 * get(r2, j) + 40 * get(r3, j)) * step;
+        out[j] += abs(int(get(black, j) * 100) / N_BITS - 50) / 5 * 10;
+    }
+}
+
+// Score every mask for all codes at once and pick the best per code into sel.
+template<int V>
+void Batch<V>::select_mask(Ecc ecc, int step, uint64_t active, uint64_t *sel)
+{
+    unsigned min_score[MAX_CODES];
+    unsigned scores[MAX_CODES];
+    uint8_t best[MAX_CODES] = {};
+
+    for (int i = 0; i < MAX_CODES; ++i)
+        min_score[i] = -1;
+
+    for (int mask = 0; mask < 8; ++mask) {
+        uint64_t only[8] = {};
+        only[mask] = ~0ull;
+
+        add_format(ecc, only);
+        apply_mask(mask, ~0ull);
+        score(step, scores);
+        for (int j = 0; j < MAX_CODES; ++j) {
+            if (scores[j] < min_score[j]) {
+                best[j] = mask;
+                min_score[j] = scores[j];
+            }
+        }
+        apply_mask(mask, ~0ull);
+    }
+
+    for (int j = 0; j < MAX_CODES; ++j)
+        sel[best[j]] |= (active >> j & 1) << j;
+}
+
+// Transpose planes back into codes.
+template<int V>
+void Batch<V>::store(Qr<V> *out, int n, uint64_t active) const
+{
+    for (int i = 0; i < N_BYTES; ++i) {
+        for (int g = 0; g * 8 < n; ++g) {
+            uint64_t x = 0;
+            for (int k = 0; k < 8; ++k)
+                x |= ((planes[i * 8 + k] >> (g * 8)) & 0xff) << (k * 8);
+
+            x = transpose_8x8(x);
+            for (int j = 0; j < 8 && g * 8 + j < n; ++j)
+                out[g * 8 + j].code[i] = uint8_t(x >> (j * 8));
+        }
+    }
+
+    for (int j = 0; j < n; ++j)
+        out[j].status = (active >> j) & 1;
+}
+
+template<int V>
+int Batch<V>::encode(const Span *payloads, int n, Ecc ecc, int mask, Qr<V> *out)
+{
+    Kernel kernel = { VERSION<V>, nullptr };
+    uint64_t active = 0;
+
+    n = n < MAX_CODES ? n : MAX_CODES;
+    memset(codewords, 0, sizeof(codewords));
+
+    for (int j = 0; j < n; ++j) {
+        uint8_t data[N_DAT_BYTES] = {};
+
+        if (kernel.encode_data(&payloads[j], 1, ecc, data)) {
+            kernel.encode_ecc(data, ecc, codewords[j]);
+            active |= 1ull << j;
+        }
+    }
+
+    place();
+
+    uint64_t sel[8] = {};
+
+    if (mask == MASK_AUTO)
+        select_mask(ecc, 1, active, sel);
+    else if (mask == MASK_FAST)
+        select_mask(ecc, VERSION<V>.sample_step ? VERSION<V>.sample_step : 1, active, sel);
+    else
+        sel[mask & 7] = active;
+
+    add_format(ecc, sel);
+    for (int i = 0; i < 8; ++i) {
+        if (sel[i])
+            apply_mask(i, sel[i]);
+    }
+
+    store(out, n, active);
+
+    int res = 0;
+    for (int j = 0; j < n; ++j)
+        res += (active >> j) & 1;
+    return res;
+}
+
+}
+
+#endif
@@ -0,0 +1,393 @@
+#ifndef QR_PIPELINE_H
+#define QR_PIPELINE_H
+
+#include "qr.h"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace qr {
+
+// Bounded lock-free multi-producer multi-consumer ring buffer. Each cell has sequence number,
+// which tells whether it's free for push or filled for pop on current lap. N must be power of 2.
+template<class T, size_t N>
+class MpmcQueue {
+public:
+    MpmcQueue();
+
+    bool push(const T &val);
+    bool pop(T &val);
+    size_t size() const;
+private:
+    static_assert(N && !(N & (N - 1)), "size must be power of 2");
+
+    struct Cell {
+        std::atomic<size_t> seq;
+        T val;
+    };
+    alignas(64) std::atomic<size_t> head = {0};
+    alignas(64) std::atomic<size_t> tail = {0};
+    Cell buf[N];
+};
+
+template<class T, size_t N>
+MpmcQueue<T, N>::MpmcQueue()
+{
+    for (size_t i = 0; i < N; ++i)
+        buf[i].seq.store(i, std::memory_order_relaxed);
+}
+
+template<class T, size_t N>
+bool MpmcQueue<T, N>::push(const T &val)
+{
+    size_t t = tail.load(std::memory_order_relaxed);
+
+    for (;;) {
+        Cell &cell = buf[t & (N - 1)];
+        ptrdiff_t diff = ptrdiff_t(cell.seq.load(std::memory_order_acquire) - t);
+
+        if (diff < 0)
+            return false;   // Full, cell isn't popped since previous lap
+
+        if (!diff && tail.compare_exchange_weak(t, t + 1, std::memory_order_relaxed)) {
+            cell.val = val;
+            cell.seq.store(t + 1, std::memory_order_release);
+            return true;
+        }
+        if (diff)
+            t = tail.load(std::memory_order_relaxed);
+    }
+}
+
+template<class T, size_t N>
+bool MpmcQueue<T, N>::pop(T &val)
+{
+    size_t h = head.load(std::memory_order_relaxed);
+
+    for (;;) {
+        Cell &cell = buf[h & (N - 1)];
+        ptrdiff_t diff = ptrdiff_t(cell.seq.load(std::memory_order_acquire) - (h + 1));
+
+        if (diff < 0)
+            return false;   // Empty, cell isn't pushed on this lap yet
+
+        if (!diff && head.compare_exchange_weak(h, h + 1, std::memory_order_relaxed)) {
+            val = cell.val;
+            cell.seq.store(h + N, std::memory_order_release);
+            return true;
+        }
+        if (diff)
+            h = head.load(std::memory_order_relaxed);
+    }
+}
+
+// Approximate number of items, exact when no push or pop is in progress.
+template<class T, size_t N>
+size_t MpmcQueue<T, N>::size() const
+{
+    size_t h = head.load(std::memory_order_acquire);
+    size_t t = tail.load(std::memory_order_acquire);
+
+    return t > h ? t - h : 0;
+}
+
+// Waiting for a queue: yield a few times, then sleep for doubling intervals up to 128 us, so
+// idle workers of a slow pipeline don't keep cores busy.
+class Backoff {
+public:
+    void wait();
+private:
+    int n = 0;
+};
+
+inline void Backoff::wait()
+{
+    if (n < 16)
+        std::this_thread::yield();
+    else
+        std::this_thread::sleep_for(std::chrono::microseconds(1 << (n < 23 ? n - 16 : 7)));
+    ++n;
+}
+
+// Statistics of one pipeline stage, summed over its workers. Throughput assumes that workers
+// run on separate cores. Depth is number of jobs waiting in the input queue of the stage, 
+// sampled each time it takes a job. For the first stage it's number of free jobs.
+struct StageStats {
+    int workers         = 1;
+    size_t items        = 0;    // Jobs processed
+    double busy         = 0;    // Seconds spent working by all workers
+    size_t depth_max    = 0;
+    double depth_sum    = 0;
+
+    double throughput() const   { return busy > 0 ? items * workers / busy : 0; }
+    double depth_avg() const    { return items ? depth_sum / items : 0; }
+};
+
+enum Stage {
+    S_DATA,
+    S_ECC,
+    S_PLACE,
+    S_MASK,
+    S_RENDER,
+    S_SINK,
+    N_STAGES,
+};
+
+// Runs encoding stages on separate threads for a stream of requests. Source is called on
+// the calling thread and runs encode_data() right away, so spans need to stay valid only
+// until the next call. Stages from S_ECC to S_RENDER may have several workers, see 
+// set_workers(). Stages are connected with MPMC queues and `Depth` preallocated jobs circulate
+// between them, so jobs may overtake each other, but sink runs on one thread and gets results 
+// in order of requests. Depth must be power of 2. S_RENDER renders each code into image of the
+// job with given scale and border.
+template<int V, size_t Depth = 64>
+class Pipeline {
+public:
+    static constexpr int MAX_WORKERS = 16;
+
+    explicit Pipeline(int scale = 1, int border = 4);
+
+    struct Request {
+        const Span *spans;
+        size_t n;
+        Ecc ecc;
+        int mask;
+    };
+
+    // Source: bool(Request &) returns false when stream ends.
+    // Sink: void(const Qr<V> &, const uint8_t *image, bool ok) where ok is false if payload 
+    // didn't fit, then image isn't rendered. Image is valid until sink returns.
+    template<class Source, class Sink>
+    size_t run(Source &&source, Sink &&sink);
+
+    // Number of threads for stage from S_ECC to S_RENDER, 1 to MAX_WORKERS. Source and sink 
+    // always have one.
+    void set_workers(Stage stage, int n);
+    int  workers(Stage stage) const             { return n_workers[stage]; }
+
+    int image_side() const                      { return (VERSION<V>.side + 2 * border) * scale; }
+
+    const StageStats& stats(Stage stage) const  { return stat[stage]; }
+    double elapsed() const                      { return seconds; }
+    static const char* stage_name(Stage stage);
+private:
+    struct Job {
+        Data<V> data;
+        Codewords<V> codewords;
+        Qr<V> qr;
+        uint8_t *image;
+        size_t seq;         // Index of request
+        bool ok;
+    };
+    using Clock = std::chrono::steady_clock;
+
+    void stage(Stage i);
+    template<class Sink>
+    void sink_stage(Sink &sink);
+    void work(Stage i, Job &job) const;
+
+    Job* take(Stage i, StageStats &st);
+    void put(Stage i, Job *job);
+    void merge(Stage i, const StageStats &st);
+private:
+    static_assert(Depth && !(Depth & (Depth - 1)), "Depth must be power of 2");
+
+    int scale;
+    int border;
+    std::unique_ptr<Job[]> jobs = std::make_unique<Job[]>(Depth);
+    std::unique_ptr<uint8_t[]> images;
+    MpmcQueue<Job*, Depth * 2> queues[N_STAGES];    // Input of each stage, S_DATA holds free jobs
+    int n_workers[N_STAGES] = { 1, 1, 1, 1, 1, 1 };
+    std::atomic<int> running[N_STAGES];             // Workers which haven't got null job yet
+    std::mutex stat_mutex;
+    StageStats stat[N_STAGES];
+    double seconds = 0;
+};
+
+template<int V, size_t Depth>
+Pipeline<V, Depth>::Pipeline(int scale, int border) 
+    : scale(scale)
+    , border(border)
+    , images(std::make_unique<uint8_t[]>(Depth * image_side() * image_side()))
+{
+    for (size_t i = 0; i < Depth; ++i)
+        jobs[i].image = &images[i * image_side() * image_side()];
+}
+
+template<int V, size_t Depth>
+void Pipeline<V, Depth>::set_workers(Stage stage, int n)
+{
+    if (stage > S_DATA && stage < S_SINK)
+        n_workers[stage] = n < 1 ? 1 : n > MAX_WORKERS ? MAX_WORKERS : n;
+}
+
+template<int V, size_t Depth>
+const char* Pipeline<V, Depth>::stage_name(Stage stage)
+{
+    constexpr const char *names[N_STAGES] = { "data", "ecc", "place", "mask", "render", "sink" };
+
+    return names[stage];
+}
+
+// Wait for job in the input queue of stage and record queue depth.
+template<int V, size_t Depth>
+typename Pipeline<V, Depth>::Job* Pipeline<V, Depth>::take(Stage i, StageStats &st)
+{
+    Job *job;
+
+    for (Backoff backoff; !queues[i].pop(job);)
+        backoff.wait();
+
+    size_t depth = queues[i].size() + 1;
+
+    st.depth_sum += depth;
+    st.depth_max  = depth > st.depth_max ? depth : st.depth_max;
+
+    return job;
+}
+
+template<int V, size_t Depth>
+void Pipeline<V, Depth>::put(Stage i, Job *job)
+{
+    for (Backoff backoff; !queues[i].push(job);)
+        backoff.wait();
+}
+
+template<int V, size_t Depth>
+void Pipeline<V, Depth>::merge(Stage i, const StageStats &st)
+{
+    std::lock_guard<std::mutex> lock(stat_mutex);
+
+    stat[i].items     += st.items;
+    stat[i].busy      += st.busy;
+    stat[i].depth_sum += st.depth_sum;
+    stat[i].depth_max  = st.depth_max > stat[i].depth_max ? st.depth_max : stat[i].depth_max;
+}
+
+template<int V, size_t Depth>
+void Pipeline<V, Depth>::work(Stage i, Job &job) const
+{
+    if (!job.ok)
+        return;
+
+    switch (i) {
+    case S_ECC:     encode_ecc(job.data, job.codewords);                            break;
+    case S_PLACE:   add_data(job.codewords, job.qr);                                break;
+    case S_MASK:    add_mask(job.qr, job.codewords.ecc, job.codewords.mask);        break;
+    case S_RENDER:  render(job.qr, job.image, scale, border);                       break;
+    default:                                                                        break;
+    }
+}
+
+// Process jobs until null job comes. The last worker of the stage to get it has seen all jobs
+// of other workers pushed, then it passes null job to each worker of next stage.
+template<int V, size_t Depth>
+void Pipeline<V, Depth>::stage(Stage i)
+{
+    Stage next = Stage(i + 1);
+    StageStats st;
+
+    for (Job *job; (job = take(i, st));) {
+        auto start = Clock::now();
+        work(i, *job);
+        st.busy += std::chrono::duration<double>(Clock::now() - start).count();
+        st.items++;
+
+        put(next, job);
+    }
+    merge(i, st);
+
+    if (running[i].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        for (int w = 0; w < n_workers[next]; ++w)
+            put(next, nullptr);
+    }
+}
+
+// Pass results to sink in order of requests. Job which comes early waits in `pending` until all
+// jobs before it are passed, then it's returned to free jobs. At most Depth jobs are in flight,
+// so their indices modulo Depth are distinct.
+template<int V, size_t Depth>
+template<class Sink>
+void Pipeline<V, Depth>::sink_stage(Sink &sink)
+{
+    Job *pending[Depth] = {};
+    size_t next = 0;
+    StageStats st;
+
+    for (Job *job; (job = take(S_SINK, st));) {
+
+        pending[job->seq & (Depth - 1)] = job;
+
+        while ((job = pending[next & (Depth - 1)])) {
+            pending[next++ & (Depth - 1)] = nullptr;
+
+            auto start = Clock::now();
+            sink(static_cast<const Qr<V>&>(job->qr), static_cast<const uint8_t*>(job->image), job->ok);
+            st.busy += std::chrono::duration<double>(Clock::now() - start).count();
+            st.items++;
+
+            put(S_DATA, job);
+        }
+    }
+    merge(S_SINK, st);
+}
+
+// Encode all requests from source and pass results to sink. Return number of requests.
+template<int V, size_t Depth>
+template<class Source, class Sink>
+size_t Pipeline<V, Depth>::run(Source &&source, Sink &&sink)
+{
+    for (int i = 0; i < N_STAGES; ++i) {
+        stat[i] = StageStats();
+        stat[i].workers = n_workers[i];
+        running[i] = n_workers[i];
+    }
+    for (size_t i = 0; i < Depth; ++i)
+        put(S_DATA, &jobs[i]);
+
+    auto start = Clock::now();
+
+    std::thread threads[(S_SINK - S_ECC) * MAX_WORKERS + 1];
+    int n_threads = 0;
+
+    for (int i = S_ECC; i < S_SINK; ++i) {
+        for (int w = 0; w < n_workers[i]; ++w)
+            threads[n_threads++] = std::thread([this, i] { stage(Stage(i)); });
+    }
+    threads[n_threads++] = std::thread([this, &sink] { sink_stage(sink); });
+
+    Request req;
+    StageStats st;
+
+    for (size_t seq = 0; source(req); ++seq) {
+        Job *job = take(S_DATA, st);
+
+        auto t = Clock::now();
+        job->seq = seq;
+        job->ok  = encode_data(req.spans, req.n, req.ecc, req.mask, job->data);
+        st.busy += std::chrono::duration<double>(Clock::now() - t).count();
+        st.items++;
+
+        put(S_ECC, job);
+    }
+    merge(S_DATA, st);
+
+    for (int w = 0; w < n_workers[S_ECC]; ++w)
+        put(S_ECC, nullptr);
+
+    for (int i = 0; i < n_threads; ++i)
+        threads[i].join();
+
+    seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    Job *job;
+    while (queues[S_DATA].pop(job));
+
+    return stat[S_DATA].items;
+}
+
+}
+
+#endif
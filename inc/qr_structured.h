@@ -0,0 +1,106 @@
+#ifndef QR_STRUCTURED_H
+#define QR_STRUCTURED_H
+
+#include "qr.h"
+#include <atomic>
+#include <thread>
+
+namespace qr {
+
+// Call work(i) for i < total on up to `n_threads` threads (0 is for hardware concurrency),
+// the calling thread is one of them. Return false if any call returned false.
+template<class F>
+bool parallel_for(int total, unsigned n_threads, F &&work)
+{
+    std::atomic<int> next = {0};
+    std::atomic<bool> ok = {true};
+
+    auto worker = [&] {
+        for (int i; (i = next.fetch_add(1)) < total;) {
+            if (!work(i))
+                ok = false;
+        }
+    };
+
+    if (!n_threads)
+        n_threads = std::thread::hardware_concurrency();
+    if (n_threads > unsigned(total))
+        n_threads = total;
+
+    std::thread threads[16];
+
+    for (unsigned i = 1; i < n_threads && i < 16; ++i)
+        threads[i] = std::thread(worker);
+    worker();
+    for (unsigned i = 1; i < n_threads && i < 16; ++i)
+        threads[i].join();
+
+    return ok;
+}
+
+// Same as encode_structured() of version V, but symbols are encoded concurrently on up to
+// `n_threads` threads (0 is for hardware concurrency). Return number of symbols or 0.
+template<int V>
+int encode_structured_parallel(const char *str, size_t len, Ecc ecc, Qr<V> *out, int max_symbols,
+    int mask = -1, unsigned n_threads = 0)
+{
+    Chunk chunks[16] = {};
+    int total = split_structured(str, len, ecc, V, V, chunks, max_symbols);
+
+    if (total == 1)
+        return out[0].encode(str, len, ecc, mask);
+    if (!total)
+        return 0;
+
+    size_t offsets[16] = {};
+    uint8_t parity = 0;
+
+    for (int i = 1; i < total; ++i)
+        offsets[i] = offsets[i - 1] + chunks[i - 1].len;
+    for (size_t i = 0; i < len; ++i)
+        parity ^= str[i];
+
+    bool ok = parallel_for(total, n_threads, [&](int i) {
+        return out[i].encode(str + offsets[i], chunks[i].len, ecc, i, total, parity, mask);
+    });
+    return ok ? total : 0;
+}
+
+// Same as encode_structured() of versions from MinV to MaxV, but symbols are encoded
+// concurrently on up to `n_threads` threads (0 is for hardware concurrency).
+template<int MinV, int MaxV>
+int encode_structured_parallel(const char *str, size_t len, Ecc ecc, Symbol *out, int max_symbols,
+    uint8_t *buf, size_t buf_size, int mask = -1, unsigned n_threads = 0)
+{
+    Chunk chunks[16] = {};
+    int total = split_structured(str, len, ecc, MinV, MaxV, chunks, max_symbols);
+
+    size_t offsets[16] = {};
+    uint8_t *modules[16] = {};
+    size_t used = 0;
+    uint8_t parity = 0;
+
+    for (int i = 0; i < total; ++i) {
+        const Version &v = version_of<MinV, MaxV>(chunks[i].ver);
+
+        if (used + v.n_bytes > buf_size)
+            return 0;
+        if (i + 1 < total)
+            offsets[i + 1] = offsets[i] + chunks[i].len;
+
+        modules[i] = buf + used;
+        out[i] = { v.ver, modules[i] };
+        used += v.n_bytes;
+    }
+    for (size_t i = 0; i < len; ++i)
+        parity ^= str[i];
+
+    bool ok = total && parallel_for(total, n_threads, [&](int i) {
+        return encode_chunk<MinV, MaxV>(str + offsets[i], chunks[i], ecc, i, total, parity, mask, modules[i]);
+    });
+    return ok ? total : 0;
+}
+
+}
+
+#endif
@@ -26,4 +26,12 @@ int main(int, char**)
     print_qr(qr);
     qr.encode(str, strlen(str), ecc, 0);
     print_qr(qr);
+
+    char buf[64];
+    int len = qr::verify(qr, buf, sizeof(buf));
+
+    if (len >= 0)
+        printf("verify: %.*s\n", len, buf);
+    else
+        printf("verify: failed\n");
 }
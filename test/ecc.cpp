@@ -0,0 +1,123 @@
+#include "qr.h"
+#include <cstdio>
+#include <cstdlib>
+
+// Corrupt codewords of encoded codes and check that verify() restores the payload when every
+// block has at most as many errors as it may correct, and fails when one block has more.
+
+// Position of j-th codeword of i-th block among interleaved codewords, see Kernel::encode_ecc().
+int interleaved(int ver, qr::Ecc ecc, int i, int j)
+{
+    const qr::Version v = qr::make_version(ver);
+
+    int n_blocks        = qr::N_ECC_BLOCKS[ecc][ver];
+    int ecc_len         = qr::ECC_CODEWORDS_PER_BLOCK[ecc][ver];
+    int n_data_bytes    = v.n_dat_capacity - ecc_len * n_blocks;
+    int n_short_blocks  = n_blocks - v.n_dat_capacity % n_blocks;
+    int short_len       = v.n_dat_capacity / n_blocks - ecc_len;
+    int data_len        = short_len + (i >= n_short_blocks);
+
+    if (j >= data_len)
+        return n_data_bytes + i + (j - data_len) * n_blocks;
+
+    return i + j * n_blocks - (j >= short_len ? n_short_blocks : 0);
+}
+
+// Flip `n_errors` distinct codewords in each of blocks [first, last] and decode the code.
+// Return number of failed trials.
+template<int V>
+int check(qr::Ecc ecc, int n_errors, int first, int last, bool correctable, int n_trials)
+{
+    static qr::Data<V> data;
+    static qr::Codewords<V> codewords;
+    static qr::Qr<V> code;
+    static char str[4000];
+    static char out[4000];
+
+    const qr::Version v = qr::make_version(V);
+
+    int n_blocks        = qr::N_ECC_BLOCKS[ecc][V];
+    int ecc_len         = qr::ECC_CODEWORDS_PER_BLOCK[ecc][V];
+    int n_short_blocks  = n_blocks - v.n_dat_capacity % n_blocks;
+    int short_len       = v.n_dat_capacity / n_blocks - ecc_len;
+    int failed          = 0;
+
+    srand(V * 4 + ecc);
+
+    for (int t = 0; t < n_trials; ++t) {
+
+        size_t len = rand() % (v.data_capacity(ecc) / 8 - 3) + 1;
+
+        for (size_t i = 0; i < len; ++i)
+            str[i] = ' ' + rand() % 95;
+
+        qr::Span span = { str, len };
+
+        if (!qr::encode_data(&span, 1, ecc, t & 7, data)) {
+            ++failed;
+            continue;
+        }
+        qr::encode_ecc(data, codewords);
+
+        for (int i = first; i <= last && i < n_blocks; ++i) {
+
+            int block_len = short_len + (i >= n_short_blocks) + ecc_len;
+            bool used[256] = {};
+
+            for (int e = 0; e < n_errors; ++e) {
+                int j;
+                do {
+                    j = rand() % block_len;
+                } while (used[j]);
+                used[j] = true;
+                codewords.codewords[interleaved(V, ecc, i, j)] ^= 1 + rand() % 255;
+            }
+        }
+
+        qr::add_data(codewords, code);
+        qr::add_mask(code, ecc, t & 7);
+
+        int res = qr::verify(code, out, sizeof(out));
+        bool ok = correctable ? res == int(len) && !memcmp(out, str, len) : res == -1;
+
+        failed += !ok;
+    }
+
+    printf("V%-2d %c  %2d blocks  %2d errors in blocks %2d-%-2d  %-13s  %s\n", V, "LMQH"[ecc],
+        n_blocks, n_errors, first, last < n_blocks ? last : n_blocks - 1,
+        correctable ? "corrected" : "rejected", failed ? "FAILED" : "ok");
+
+    return failed;
+}
+
+// Correct as many errors as allowed in every block, reject one error more in a single block.
+template<int V>
+int check(qr::Ecc ecc, int n_trials)
+{
+    int t = (qr::ECC_CODEWORDS_PER_BLOCK[ecc][V] - qr::misdecode_codewords(V, ecc)) / 2;
+
+    return check<V>(ecc, t, 0, 80, true, n_trials) + check<V>(ecc, t + 1, 0, 0, false, n_trials);
+}
+
+int main(int, char**)
+{
+    int failed = 0;
+
+    // Codes with misdecode protection codewords
+    failed += check<1>(qr::L, 50);
+    failed += check<1>(qr::M, 50);
+    failed += check<1>(qr::Q, 50);
+    failed += check<1>(qr::H, 50);
+    failed += check<2>(qr::L, 50);
+    failed += check<3>(qr::L, 50);
+
+    // Several blocks of different lengths
+    failed += check<5>(qr::Q, 50);
+    failed += check<5>(qr::H, 50);
+    failed += check<7>(qr::H, 50);
+    failed += check<10>(qr::Q, 20);
+    failed += check<15>(qr::H, 20);
+    failed += check<40>(qr::Q, 5);
+
+    return failed != 0;
+}
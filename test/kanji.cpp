@@ -0,0 +1,34 @@
+#include "qr.h"
+#include <cstdio>
+
+// Encode every 2-byte payload and check that it's decoded back unchanged, and that kanji mode
+// is selected only for valid Shift JIS pairs (trail byte first).
+int main(int, char**)
+{
+    qr::Qr<1> code;
+    char out[16];
+    int n_kanji = 0;
+    int failed  = 0;
+
+    for (int a = 0; a < 256; ++a) {
+        for (int b = 0; b < 256; ++b) {
+
+            const char str[2] = { char(a), char(b) };
+            uint16_t val = a | b << 8;
+            bool kanji = a >= 0x40 && a <= 0xfc && a != 0x7f &&
+                ((val >= 0x8140 && val <= 0x9ffc) || (val >= 0xe040 && val <= 0xebbf));
+
+            n_kanji += kanji;
+            failed  += (qr::select_mode(str, 2) == qr::M_KANJI) != kanji;
+
+            if (!code.encode(str, 2, qr::L, 0) || qr::verify(code, out, sizeof(out)) != 2 ||
+                out[0] != str[0] || out[1] != str[1]) {
+                if (failed++ < 10)
+                    printf("Pair %02x %02x is not restored\n", a, b);
+            }
+        }
+    }
+    printf("%d pairs, %d kanji, %d failed\n", 256 * 256, n_kanji, failed);
+
+    return failed != 0;
+}
@@ -0,0 +1,74 @@
+#include "qr.h"
+#include <cstdio>
+#include <cstdlib>
+
+// Split payloads of every mode into Structured Append sequences of one version and of a range
+// of versions, decode every code and check that codes join back into the payload. Range never
+// takes larger sum of versions than its largest version alone.
+template<int MinV, int MaxV>
+int check(const char *str, size_t len, qr::Ecc ecc, const char *name)
+{
+    static uint8_t buf[16 * qr::VERSION<MaxV>.n_bytes];
+    static qr::Symbol mixed[16];
+    static qr::Qr<MaxV> fixed[16];
+    static char out[16 * 3000];
+
+    int n_mixed = qr::encode_structured<MinV, MaxV>(str, len, ecc, mixed, 16, buf, sizeof(buf));
+    int n_fixed = qr::encode_structured(str, len, ecc, fixed, 16);
+    int sum     = 0;
+    size_t pos  = 0;
+    bool ok     = n_mixed > 0 && n_fixed > 0;
+
+    for (int i = 0; i < n_mixed; ++i) {
+        int res = qr::verify<MinV, MaxV>(mixed[i], out + pos, sizeof(out) - pos);
+        ok  &= res >= 0 && mixed[i].ver >= MinV && mixed[i].ver <= MaxV;
+        pos += res > 0 ? res : 0;
+        sum += mixed[i].ver;
+    }
+    ok &= pos == len && !memcmp(out, str, len) && sum <= n_fixed * MaxV;
+
+    pos = 0;
+    for (int i = 0; i < n_fixed; ++i) {
+        int res = qr::verify(fixed[i], out + pos, sizeof(out) - pos);
+        ok  &= res >= 0;
+        pos += res > 0 ? res : 0;
+    }
+    ok &= pos == len && !memcmp(out, str, len);
+
+    printf("%-8s %5zu bytes  V%d-%-2d  %2d codes, sum %3d  V%-2d %2d codes, sum %3d  %s\n", name, len,
+        MinV, MaxV, n_mixed, sum, MaxV, n_fixed, n_fixed * MaxV, ok ? "ok" : "FAILED");
+
+    return !ok;
+}
+
+int main(int, char**)
+{
+    static char numeric[6000];
+    static char alnum[3000];
+    static char bytes[2000];
+    static char kanji[2000];
+
+    srand(1);
+    for (size_t i = 0; i < sizeof(numeric); ++i)
+        numeric[i] = '0' + rand() % 10;
+    for (size_t i = 0; i < sizeof(alnum); ++i)
+        alnum[i] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:"[rand() % 45];
+    for (size_t i = 0; i < sizeof(bytes); ++i)
+        bytes[i] = rand();
+    for (size_t i = 0; i < sizeof(kanji); i += 2) {
+        kanji[i]     = 0x40 + rand() % 0x3f;
+        kanji[i + 1] = 0x81 + rand() % 0x1f;
+    }
+
+    int failed = 0;
+
+    failed += check<1, 10>(numeric, sizeof(numeric), qr::M, "numeric");
+    failed += check<5, 20>(numeric, sizeof(numeric), qr::L, "numeric");
+    failed += check<1, 10>(alnum, sizeof(alnum), qr::Q, "alnum");
+    failed += check<1, 15>(bytes, sizeof(bytes), qr::M, "byte");
+    failed += check<1, 10>(kanji, sizeof(kanji), qr::H, "kanji");
+    failed += check<1, 20>(kanji, 1501, qr::M, "kanji");
+    failed += check<3, 3>(alnum, 200, qr::L, "alnum");
+
+    return failed != 0;
+}